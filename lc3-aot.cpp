@@ -0,0 +1,302 @@
+/*
+ * Ahead-of-time translator, turns an .obj image into a C++ program with
+ * one function per basic block. Code is found by walking the reachable
+ * control flow from 0x3000 and the trap vectors. Each instruction becomes
+ * a call to ins<op> from lc3-vm.h with a constant instr, so -O3 folds the
+ * decoding away. Indirect jumps (JMP/JSRR/RET) look their target up in the
+ * block table, and anything untranslated or rewritten at run time goes
+ * through the interpreter instead.
+ *
+ * g++ -O2 lc3-aot.cpp -o lc3-aot
+ * ./lc3-aot -o 2048.cpp 2048.obj && g++ -O3 -I. 2048.cpp -o 2048
+ */
+
+#include <stdint.h> // uint16_t
+#include <stdio.h>  // FILE
+#include <stdlib.h> // exit
+#include <string.h> // strcmp
+#include <vector>
+
+#include "lc3-vm.h"
+
+
+/* Segment: one loaded .obj */
+struct Segment
+{
+    uint16_t origin;
+    uint32_t count;
+};
+
+Image* image;
+uint8_t loaded[1 << 16];     /* words that came from an image */
+uint8_t is_ins[1 << 16];     /* reached as an instruction */
+uint8_t leader[1 << 16];     /* starts a basic block */
+std::vector<Segment> segments;
+std::vector<uint16_t> work;
+
+
+/* Load, like read_image_file but remembers what was loaded */
+int load(const char* image_path)
+{
+    FILE* file = fopen(image_path, "rb");
+    if (!file) { return 0; }
+
+    uint16_t origin;
+    if (fread(&origin, sizeof(origin), 1, file) != 1)
+    {
+        fclose(file);
+        return 0;
+    }
+    origin = swap16(origin);
+
+    size_t max_read = (1 << 16) - origin;
+    uint16_t* p = image->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+    fclose(file);
+
+    Segment segment = { origin, (uint32_t)read };
+    segments.push_back(segment);
+    for (size_t i = 0; i < read; ++i)
+    {
+        p[i] = swap16(p[i]);
+        loaded[origin + i] = 1;
+    }
+    return 1;
+}
+
+/* Control Flow */
+inline int is_terminator(uint16_t op)
+{
+    return op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP;
+}
+
+void add_leader(uint16_t address)
+{
+    if (loaded[address])
+    {
+        leader[address] = 1;
+        work.push_back(address);
+    }
+}
+
+void walk(uint16_t entry)
+{
+    add_leader(entry);
+    while (!work.empty())
+    {
+        uint16_t a = work.back();
+        work.pop_back();
+
+        while (loaded[a] && !is_ins[a])
+        {
+            uint16_t instr = image->memory[a];
+            uint16_t op = instr >> 12;
+            uint16_t next = a + 1;
+
+            /* left to the interpreter */
+            if (op == OP_RTI || op == OP_RES) { break; }
+            is_ins[a] = 1;
+
+            if (is_terminator(op)) { leader[next] = 1; }
+            if (op == OP_BR)
+            {
+                uint16_t cond = (instr >> 9) & 0x7;
+                if (cond) { add_leader(next + sign_extend(instr & 0x1FF, 9)); }
+                if (cond == 0x7) { break; }
+            }
+            if (op == OP_JSR && ((instr >> 11) & 1))
+            {
+                add_leader(next + sign_extend(instr & 0x7FF, 11));
+            }
+            /* indirect, resolved through the block table at run time */
+            if (op == OP_JMP) { break; }
+            if (op == OP_TRAP && (instr & 0xFF) == TRAP_HALT) { break; }
+
+            a = next;
+        }
+    }
+}
+
+
+/* Emit */
+void emit_page_check(FILE* out, uint16_t start, uint16_t end, const char* exit_code)
+{
+    /* every page the block covers, a store to any of them clears PAGE_CODE */
+    fprintf(out, "    if (!(");
+    for (uint32_t p = start >> PAGE_BITS; p <= (uint32_t)(end >> PAGE_BITS); ++p)
+    {
+        fprintf(out, "vm->pflags[0x%02X] & ", p);
+    }
+    fprintf(out, "PAGE_CODE)) { %s }\n", exit_code);
+}
+
+void emit_block(FILE* out, uint16_t start, uint16_t end)
+{
+    fprintf(out, "static int b_%04X(VM* vm)\n{\n", start);
+    emit_page_check(out, start, end, "return 0;");
+
+    for (uint32_t a = start; a <= end; ++a)
+    {
+        uint16_t instr = image->memory[a];
+        uint16_t op = instr >> 12;
+        uint16_t next = a + 1;
+
+        /* only the ops that read the incremented pc need it up to date */
+        if (0xCC1D & (1 << op))
+        {
+            fprintf(out, "    vm->reg[R_PC] = 0x%04X;\n", next);
+        }
+        fprintf(out, "    ins<%u>(vm, 0x%04X);\n", op, instr);
+
+        /* a store may have rewritten the rest of this block */
+        if ((0x0888 & (1 << op)) && a != end)
+        {
+            char exit_code[64];
+            snprintf(exit_code, sizeof(exit_code), "vm->reg[R_PC] = 0x%04X; return %u;",
+                     next, a - start + 1);
+            emit_page_check(out, start, end, exit_code);
+        }
+    }
+
+    if (!is_terminator(image->memory[end] >> 12))
+    {
+        fprintf(out, "    vm->reg[R_PC] = 0x%04X;\n", (uint16_t)(end + 1));
+    }
+    fprintf(out, "    return %u;\n}\n\n", end - start + 1);
+}
+
+void emit(FILE* out, const char* source)
+{
+    fprintf(out, "/* Translated from %s by lc3-aot */\n\n", source);
+    fprintf(out, "#include \"lc3-vm.h\"\n\n");
+    fprintf(out, "typedef int (*Block)(VM*);\n\n");
+    fprintf(out, "static Block blocks[1 << 16];\n");
+    fprintf(out, "static uint8_t code_map[1 << 16];\n\n");
+
+    /* Segments */
+    for (size_t s = 0; s < segments.size(); ++s)
+    {
+        fprintf(out, "static const uint16_t segment_%zu[] = {", s);
+        for (uint32_t i = 0; i < segments[s].count; ++i)
+        {
+            fprintf(out, "%s0x%04X,", i % 8 ? " " : "\n    ", image->memory[segments[s].origin + i]);
+        }
+        fprintf(out, "\n};\n\n");
+    }
+
+    /* Blocks */
+    std::vector<uint16_t> starts, ends;
+    for (uint32_t a = 0; a < (1 << 16); ++a)
+    {
+        if (!is_ins[a]) { continue; }
+
+        uint16_t end = a;
+        while (!is_terminator(image->memory[end] >> 12)
+               && end != 0xFFFF && is_ins[end + 1] && !leader[end + 1])
+        {
+            ++end;
+        }
+        emit_block(out, a, end);
+        starts.push_back(a);
+        ends.push_back(end);
+        a = end;
+    }
+
+    /* Main */
+    fprintf(out, "int main()\n{\n");
+    fprintf(out, "    Image* image = image_alloc();\n");
+    for (size_t s = 0; s < segments.size(); ++s)
+    {
+        fprintf(out, "    memcpy(image->memory + 0x%04X, segment_%zu, sizeof(segment_%zu));\n",
+                segments[s].origin, s, s);
+    }
+    fprintf(out, "\n    VM vm;\n");
+    fprintf(out, "    vm_init(&vm, image, stdin, stdout);\n");
+    fprintf(out, "    vm.code_map = code_map;\n");
+
+    uint8_t code_pages[PAGE_COUNT] = {};
+    size_t translated = 0;
+    for (size_t b = 0; b < starts.size(); ++b)
+    {
+        translated += ends[b] - starts[b] + 1;
+        fprintf(out, "    blocks[0x%04X] = b_%04X; memset(code_map + 0x%04X, 1, %u);\n",
+                starts[b], starts[b], starts[b], ends[b] - starts[b] + 1);
+        for (uint32_t p = starts[b] >> PAGE_BITS; p <= (uint32_t)(ends[b] >> PAGE_BITS); ++p)
+        {
+            code_pages[p] = 1;
+        }
+    }
+    for (int p = 0; p < PAGE_COUNT; ++p)
+    {
+        if (code_pages[p]) { fprintf(out, "    vm.pflags[0x%02X] |= PAGE_CODE;\n", p); }
+    }
+
+    fprintf(out,
+            "\n"
+            "    signal(SIGINT, handle_interrupt);\n"
+            "    disable_input_buffering();\n"
+            "\n"
+            "    while (vm.running)\n"
+            "    {\n"
+            "        /* untranslated or rewritten code goes through the interpreter */\n"
+            "        Block block = blocks[vm.reg[R_PC]];\n"
+            "        if (!block || !block(&vm))\n"
+            "        {\n"
+            "            vm_run(&vm, 1);\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    restore_input_buffering();\n"
+            "}\n");
+
+    fprintf(stderr, "%zu blocks, %zu translated instructions\n", starts.size(), translated);
+
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    const char* out_path = NULL;
+    int j = 1;
+    if (j + 1 < argc && !strcmp(argv[j], "-o"))
+    {
+        out_path = argv[j + 1];
+        j += 2;
+    }
+
+    if (j >= argc)
+    {
+        /* show usage string */
+        printf("lc3-aot [-o output.cpp] [image-file1] ...\n");
+        exit(2);
+    }
+
+    image = image_alloc();
+    const char* source = argv[j];
+    for (; j < argc; ++j)
+    {
+        if (!load(argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+
+    /* Discover Code */
+    walk(PC_START);
+    for (uint16_t v = TRAP_GETC; v <= TRAP_HALT; ++v)
+    {
+        if (loaded[v]) { walk(image->memory[v]); }
+    }
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out)
+    {
+        printf("failed to open output: %s\n", out_path);
+        exit(1);
+    }
+    emit(out, source);
+    if (out != stdout) { fclose(out); }
+    free(image);
+}
@@ -0,0 +1,277 @@
+/*
+ * Benchmark runner for the dispatch strategies. Runs an image on each
+ * engine for a fixed instruction budget and reads the Linux hardware
+ * counters around every run, so we can see why one engine is faster:
+ * host cycles per guest instruction, branch misses per dispatch, L1i and
+ * iTLB misses. Counters the host can't provide are reported as n/a.
+ *
+ * g++ -O3 lc3-bench.cpp -o lc3-bench
+ */
+
+#include <stdint.h>             // uint16_t
+#include <stdio.h>              // FILE
+#include <stdlib.h>             // strtoull
+#include <string.h>             // strcmp
+#include <linux/perf_event.h>   // perf_event_attr
+#include <sys/ioctl.h>          // ioctl
+#include <sys/syscall.h>        // SYS_perf_event_open
+#include <unistd.h>             // syscall
+
+#include "lc3-vm.h"
+
+
+/* Switch Engine, the dispatch of lc3.c with the ins<op> bodies inlined */
+uint64_t run_switch(VM* vm, uint64_t budget)
+{
+    uint64_t n = 0;
+    while (vm->running && n < budget)
+    {
+        uint16_t instr = mem_read(vm, vm->reg[R_PC]++);
+        switch (instr >> 12)
+        {
+            case OP_BR: ins<OP_BR>(vm, instr); break;
+            case OP_ADD: ins<OP_ADD>(vm, instr); break;
+            case OP_LD: ins<OP_LD>(vm, instr); break;
+            case OP_ST: ins<OP_ST>(vm, instr); break;
+            case OP_JSR: ins<OP_JSR>(vm, instr); break;
+            case OP_AND: ins<OP_AND>(vm, instr); break;
+            case OP_LDR: ins<OP_LDR>(vm, instr); break;
+            case OP_STR: ins<OP_STR>(vm, instr); break;
+            case OP_NOT: ins<OP_NOT>(vm, instr); break;
+            case OP_LDI: ins<OP_LDI>(vm, instr); break;
+            case OP_STI: ins<OP_STI>(vm, instr); break;
+            case OP_JMP: ins<OP_JMP>(vm, instr); break;
+            case OP_LEA: ins<OP_LEA>(vm, instr); break;
+            case OP_TRAP: ins<OP_TRAP>(vm, instr); break;
+            case OP_RES:
+            case OP_RTI:
+            default:
+                ins_bad(vm, instr);
+                break;
+        }
+        ++n;
+    }
+    return n;
+}
+
+/* Table Engine, the op_table of lc3-alt.cpp */
+uint64_t run_table(VM* vm, uint64_t budget)
+{
+    return vm_run(vm, budget);
+}
+
+/* Engines, add new dispatch strategies here */
+struct Engine
+{
+    const char* name;
+    uint64_t (*run)(VM*, uint64_t);
+};
+
+static const Engine engines[] = {
+    { "switch", run_switch },
+    { "table", run_table },
+};
+
+
+/* Counters */
+enum
+{
+    C_CYCLES = 0,
+    C_INSTRUCTIONS,
+    C_BRANCH_MISSES,
+    C_L1I_MISSES,
+    C_ITLB_MISSES,
+    C_COUNT
+};
+
+static const char* counter_names[C_COUNT] = {
+    "cycles", "instructions", "branch-misses", "L1i-misses", "iTLB-misses"
+};
+
+struct Counters
+{
+    int fd[C_COUNT];
+    double value[C_COUNT]; /* scaled for multiplexing, < 0 when unavailable */
+};
+
+int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void counters_open(Counters* c)
+{
+    const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    c->fd[C_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    c->fd[C_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    c->fd[C_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    c->fd[C_L1I_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | read_miss);
+    c->fd[C_ITLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | read_miss);
+}
+
+void counters_start(Counters* c)
+{
+    for (int i = 0; i < C_COUNT; ++i)
+    {
+        if (c->fd[i] < 0) { continue; }
+        ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void counters_stop(Counters* c)
+{
+    for (int i = 0; i < C_COUNT; ++i)
+    {
+        c->value[i] = -1;
+        if (c->fd[i] < 0) { continue; }
+        ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        /* value, time enabled, time running */
+        uint64_t data[3];
+        if (read(c->fd[i], data, sizeof(data)) == sizeof(data) && data[2])
+        {
+            c->value[i] = (double)data[0] * data[1] / data[2];
+        }
+    }
+}
+
+void counters_close(Counters* c)
+{
+    for (int i = 0; i < C_COUNT; ++i)
+    {
+        if (c->fd[i] >= 0) { close(c->fd[i]); }
+    }
+}
+
+
+/* Report */
+void print_ratio(const char* label, double num, double den, double scale)
+{
+    if (num < 0 || den <= 0)
+    {
+        printf("  %-26s n/a\n", label);
+    }
+    else
+    {
+        printf("  %-26s %.3f\n", label, num / den * scale);
+    }
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    uint64_t budget = 100000000;
+    int repeats = 3;
+    const char* input_path = NULL;
+    const char* only = NULL;
+
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-b")) { budget = strtoull(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-r")) { repeats = atoi(argv[j + 1]); }
+        else if (!strcmp(argv[j], "-i")) { input_path = argv[j + 1]; }
+        else if (!strcmp(argv[j], "-e")) { only = argv[j + 1]; }
+        else { break; }
+    }
+
+    int known = !only;
+    for (const Engine& engine : engines)
+    {
+        if (only && !strcmp(only, engine.name)) { known = 1; }
+    }
+    if (!known)
+    {
+        printf("unknown engine: %s\n", only);
+    }
+
+    if (j >= argc || repeats < 1 || !known)
+    {
+        /* show usage string */
+        printf("lc3-bench [-b budget] [-r repeats] [-i input] [-e engine] [image-file1] ...\n");
+        exit(2);
+    }
+
+    Image* image = image_alloc();
+    for (; j < argc; ++j)
+    {
+        if (!read_image(image, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+
+    FILE* null_out = fopen("/dev/null", "wb");
+    Counters counters;
+    counters_open(&counters);
+    for (int i = 0; i < C_COUNT; ++i)
+    {
+        if (counters.fd[i] < 0) { fprintf(stderr, "counter unavailable: %s\n", counter_names[i]); }
+    }
+
+    for (const Engine& engine : engines)
+    {
+        if (only && strcmp(only, engine.name)) { continue; }
+
+        /* best of the repeats, by cycles when we have them */
+        double best[C_COUNT];
+        double best_time = 0;
+        uint64_t executed = 0;
+        for (int r = 0; r < repeats; ++r)
+        {
+            FILE* in = input_path ? fopen(input_path, "rb") : fopen("/dev/null", "rb");
+            if (!in)
+            {
+                printf("failed to load input: %s\n", input_path);
+                exit(1);
+            }
+
+            VM vm;
+            vm_init(&vm, image, in, null_out);
+
+            double t0 = now();
+            counters_start(&counters);
+            executed = engine.run(&vm, budget);
+            counters_stop(&counters);
+            double t = now() - t0;
+
+            vm_free(&vm);
+            fclose(in);
+
+            int better = r == 0 || (counters.value[C_CYCLES] >= 0
+                                    ? counters.value[C_CYCLES] < best[C_CYCLES]
+                                    : t < best_time);
+            if (better)
+            {
+                memcpy(best, counters.value, sizeof(best));
+                best_time = t;
+            }
+        }
+
+        double n = (double)executed;
+        printf("%s: %llu instructions in %.3f s, %.1f MIPS\n",
+               engine.name, (unsigned long long)executed, best_time, n / best_time / 1e6);
+        print_ratio("cycles / instruction", best[C_CYCLES], n, 1);
+        print_ratio("host instr / instruction", best[C_INSTRUCTIONS], n, 1);
+        print_ratio("IPC", best[C_INSTRUCTIONS], best[C_CYCLES], 1);
+        print_ratio("branch misses / dispatch", best[C_BRANCH_MISSES], n, 1);
+        print_ratio("L1i misses / 1k dispatch", best[C_L1I_MISSES], n, 1000);
+        print_ratio("iTLB misses / 1k dispatch", best[C_ITLB_MISSES], n, 1000);
+    }
+
+    counters_close(&counters);
+    free(image);
+}
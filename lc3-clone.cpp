@@ -0,0 +1,125 @@
+/*
+ * Loads an image once, optionally warms it up, then clones it into many
+ * VM instances that share the pristine pages copy-on-write. Reports how
+ * much memory the instances really needed compared to a full 128 KB each.
+ *
+ * g++ -O2 lc3-clone.cpp -o lc3-clone
+ */
+
+#include <stdint.h>       // uint16_t
+#include <stdio.h>        // FILE
+#include <stdlib.h>       // strtoull
+#include <string.h>       // strcmp
+#include <sys/resource.h> // getrusage
+
+#include "lc3-vm.h"
+
+
+/* Open Input, unbuffered so 10,000 instances don't each hold a BUFSIZ */
+FILE* open_input(char* data, size_t size, FILE* null_in)
+{
+    if (!size) { return null_in; }
+    FILE* in = fmemopen(data, size, "r");
+    setvbuf(in, NULL, _IONBF, 0);
+    return in;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    uint64_t instances = 1000;
+    uint64_t warmup = 0;
+    uint64_t budget = 1000000;
+    const char* input_path = NULL;
+
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-n")) { instances = strtoull(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-w")) { warmup = strtoull(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-b")) { budget = strtoull(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-i")) { input_path = argv[j + 1]; }
+        else { break; }
+    }
+
+    if (j >= argc || instances == 0)
+    {
+        /* show usage string */
+        printf("lc3-clone [-n instances] [-w warmup] [-b budget] [-i input] [image-file1] ...\n");
+        exit(2);
+    }
+
+    Image* image = image_alloc();
+    for (; j < argc; ++j)
+    {
+        if (!read_image(image, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+
+    size_t input_size = 0;
+    char* input = NULL;
+    if (input_path && !(input = read_file(input_path, &input_size)))
+    {
+        printf("failed to load input: %s\n", input_path);
+        exit(1);
+    }
+
+    FILE* null_in = fopen("/dev/null", "rb");
+    FILE* null_out = fopen("/dev/null", "wb");
+
+    /* Warm Up, run once and freeze the result as the new image */
+    if (warmup)
+    {
+        VM vm;
+        vm_init(&vm, image, null_in, null_out);
+        vm_run(&vm, warmup);
+        image_snapshot(image, &vm);
+        vm_free(&vm);
+    }
+
+    /* Clone, every instance stays alive so the totals are concurrent */
+    VM* vms = (VM*)calloc(instances, sizeof(VM));
+    if (!vms) { abort(); }
+
+    uint64_t executed = 0;
+    uint64_t private_pages = 0;
+    for (uint64_t i = 0; i < instances; ++i)
+    {
+        /* only the first instance gets to talk */
+        FILE* out = i == 0 ? stdout : null_out;
+        vm_init(&vms[i], image, open_input(input, input_size, null_in), out);
+        executed += vm_run(&vms[i], budget);
+        private_pages += vms[i].private_pages;
+    }
+
+    /* Report */
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double shared_kb = sizeof(Image) / 1024.0;
+    double table_kb = instances * sizeof(VM) / 1024.0;
+    double private_kb = private_pages * PAGE_SIZE * sizeof(uint16_t) / 1024.0;
+    double flat_kb = instances * (double)(sizeof(uint16_t) << 16) / 1024.0;
+
+    fprintf(stderr, "\ninstances:     %llu\n", (unsigned long long)instances);
+    fprintf(stderr, "instructions:  %llu\n", (unsigned long long)executed);
+    fprintf(stderr, "private pages: %llu (%.1f per instance)\n",
+            (unsigned long long)private_pages, (double)private_pages / instances);
+    fprintf(stderr, "memory:        %.0f KB shared + %.0f KB page tables + %.0f KB private\n",
+            shared_kb, table_kb, private_kb);
+    fprintf(stderr, "flat copies:   %.0f KB\n", flat_kb);
+    fprintf(stderr, "max rss:       %ld KB\n", usage.ru_maxrss);
+
+    for (uint64_t i = 0; i < instances; ++i)
+    {
+        if (vms[i].in != null_in) { fclose(vms[i].in); }
+        vm_free(&vms[i]);
+    }
+    free(vms);
+    free(image);
+    free(input);
+}
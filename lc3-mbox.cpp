@@ -0,0 +1,460 @@
+/*
+ * Runs several LC-3 programs at once, one VM per host thread, connected
+ * by a memory-mapped mailbox device. Every VM owns a lock-free MPSC queue
+ * of 16-bit words that any other VM can send to, so programs can be wired
+ * up as pipelines or worker farms and we can measure how they scale
+ * across host cores.
+ *
+ * Mailbox registers, next to the keyboard pair:
+ *   MBSR  bit 15 set while a word is waiting, bit 0 set when the last
+ *         send was dropped (no such mailbox, its VM has stopped, or it
+ *         is our own and full)
+ *   MBDR  load takes the next word (0 when empty), store sends to MBTR,
+ *         waiting for room while the target mailbox is full
+ *   MBTR  mailbox that MBDR stores go to
+ *   MBID  this VM's mailbox, read only
+ *   MBNR  number of mailboxes, read only
+ *   MBCR  bit 0 makes MBDR loads wait for a word, spinning and then
+ *         parking the host thread
+ *
+ * If every VM still running is parked, waiting for a word or for room
+ * that nobody will make, they all stop instead of hanging.
+ *
+ * lc3-mbox [-b budget] [-n copies] [image-file1] ...
+ *
+ * g++ -O2 -pthread lc3-mbox.cpp -o lc3-mbox
+ */
+
+#include <stdint.h> // uint16_t
+#include <stdio.h>  // FILE
+#include <stdlib.h> // strtoull
+#include <string.h> // strcmp
+#include <sched.h>  // sched_yield
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lc3-vm.h"
+
+
+/* Mailbox Registers */
+enum
+{
+    MR_MBSR = 0xFE10, /* mailbox status */
+    MR_MBDR = 0xFE12, /* mailbox data */
+    MR_MBTR = 0xFE14, /* mailbox target */
+    MR_MBID = 0xFE16, /* own mailbox */
+    MR_MBNR = 0xFE18, /* mailbox count */
+    MR_MBCR = 0xFE1A  /* mailbox control */
+};
+
+enum
+{
+    MB_WAIT = 1 << 0,       /* MBCR: MBDR loads wait for a word */
+    MB_DROPPED = 1 << 0,    /* MBSR: the last send went nowhere */
+    MB_READY = 1 << 15,     /* MBSR: a word is waiting */
+    MBOX_SIZE = 1 << 12,    /* words per queue, a power of two */
+    MBOX_SPIN = 1 << 10     /* empty or full polls before parking */
+};
+
+
+/* Mailbox: bounded MPSC ring, each slot's sequence number says whose turn it is */
+struct Slot
+{
+    std::atomic<uint32_t> seq;
+    uint16_t val;
+};
+
+struct Mailbox
+{
+    alignas(64) std::atomic<uint32_t> tail; /* producers */
+    alignas(64) uint32_t head;              /* the owning VM only */
+    Slot slots[MBOX_SIZE];
+};
+
+void mbox_init(Mailbox* mb)
+{
+    mb->tail.store(0, std::memory_order_relaxed);
+    mb->head = 0;
+    for (uint32_t i = 0; i < MBOX_SIZE; ++i)
+    {
+        mb->slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+int mbox_push(Mailbox* mb, uint16_t val)
+{
+    uint32_t pos = mb->tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Slot* slot = &mb->slots[pos & (MBOX_SIZE - 1)];
+        int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (mb->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                slot->val = val;
+                slot->seq.store(pos + 1, std::memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0; /* full */
+        }
+        else
+        {
+            pos = mb->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+int mbox_pop(Mailbox* mb, uint16_t* val)
+{
+    Slot* slot = &mb->slots[mb->head & (MBOX_SIZE - 1)];
+    if (slot->seq.load(std::memory_order_acquire) != mb->head + 1)
+    {
+        return 0;
+    }
+    *val = slot->val;
+    slot->seq.store(mb->head + MBOX_SIZE, std::memory_order_release);
+    ++mb->head;
+    return 1;
+}
+
+int mbox_room(Mailbox* mb)
+{
+    uint32_t pos = mb->tail.load(std::memory_order_relaxed);
+    Slot* slot = &mb->slots[pos & (MBOX_SIZE - 1)];
+    return (int32_t)(slot->seq.load(std::memory_order_acquire) - pos) >= 0;
+}
+
+int mbox_ready(Mailbox* mb)
+{
+    Slot* slot = &mb->slots[mb->head & (MBOX_SIZE - 1)];
+    return slot->seq.load(std::memory_order_acquire) == mb->head + 1;
+}
+
+
+/* Network: every node, plus the parking lot for waiting readers and senders */
+struct Node;
+
+struct Network
+{
+    std::vector<Node*> nodes;
+    std::mutex park_lock;
+    std::condition_variable park_ready;
+    std::atomic<int> parked; /* readers not yet woken by a sender, and blocked senders */
+    std::atomic<int> live;
+    int deadlock;          /* under park_lock */
+};
+
+struct Node
+{
+    VM vm;
+    Mailbox box;
+    Network* net;
+    uint16_t id;
+    int asleep;            /* under park_lock, counted in parked */
+    Node* blocked_on;      /* under park_lock, the full mailbox we wait to send to */
+    std::atomic<int> left; /* our VM has stopped, nobody pops our mailbox */
+    int dropped;           /* the last send went nowhere, shown in MBSR */
+    char* output;
+    size_t output_size;
+    uint64_t executed;
+    uint64_t sent;
+    uint64_t parks;
+    uint64_t drops;
+};
+
+/* wake the receiver if it is parked, only pays for the lock when someone sleeps */
+void net_wake(Network* net, Node* receiver)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (net->parked.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> guard(net->park_lock);
+        if (receiver->asleep)
+        {
+            /* it has a word now, so it no longer counts towards a deadlock */
+            receiver->asleep = 0;
+            net->parked.fetch_sub(1);
+        }
+        net->park_ready.notify_all();
+    }
+}
+
+void net_leave(Node* node)
+{
+    Network* net = node->net;
+    std::lock_guard<std::mutex> guard(net->park_lock);
+    node->left = 1;
+    net->live.fetch_sub(1);
+    net->park_ready.notify_all();
+}
+
+/* everyone left is waiting on everyone else, under park_lock */
+int net_stuck(Network* net)
+{
+    if (net->parked.load() != net->live.load()) { return 0; }
+    for (Node* n : net->nodes)
+    {
+        /* a blocked sender that can go on just hasn't looked yet */
+        Node* target = n->blocked_on;
+        if (target && (target->left || mbox_room(&target->box))) { return 0; }
+    }
+    return 1;
+}
+
+void net_stop(Network* net, Node* node)
+{
+    net->deadlock = 1;
+    net->park_ready.notify_all();
+    node->vm.running = 0;
+}
+
+uint16_t node_receive(Node* node)
+{
+    uint16_t val;
+    for (int i = 0; i < MBOX_SPIN; ++i)
+    {
+        if (mbox_pop(&node->box, &val)) { return val; }
+    }
+
+    Network* net = node->net;
+    std::unique_lock<std::mutex> guard(net->park_lock);
+    ++node->parks;
+    node->asleep = 1;
+    net->parked.fetch_add(1);
+    for (;;)
+    {
+        if (mbox_pop(&node->box, &val)) { break; }
+        if (!node->asleep)
+        {
+            /* woken for a word we had already taken, park again so the
+               next sender wakes us, then look once more */
+            node->asleep = 1;
+            net->parked.fetch_add(1);
+            continue;
+        }
+        if (net->deadlock || net_stuck(net))
+        {
+            net_stop(net, node);
+            val = 0;
+            break;
+        }
+        net->park_ready.wait(guard);
+    }
+    if (node->asleep)
+    {
+        node->asleep = 0;
+        net->parked.fetch_sub(1);
+    }
+    return val;
+}
+
+/* park until the receiver's full mailbox has room, returns 0 if it never will */
+int node_block(Node* node, Node* receiver, uint16_t val)
+{
+    Network* net = node->net;
+    std::unique_lock<std::mutex> guard(net->park_lock);
+    ++node->parks;
+    node->blocked_on = receiver;
+    net->parked.fetch_add(1);
+    int pushed = 0;
+    for (;;)
+    {
+        if (mbox_push(&receiver->box, val))
+        {
+            pushed = 1;
+            break;
+        }
+        if (net->deadlock || net_stuck(net))
+        {
+            net_stop(net, node);
+            break;
+        }
+        if (receiver->left) { break; }
+        /* readers don't signal when they make room, so look again shortly */
+        net->park_ready.wait_for(guard, std::chrono::milliseconds(1));
+    }
+    node->blocked_on = NULL;
+    net->parked.fetch_sub(1);
+    return pushed;
+}
+
+int node_send(Node* node, uint16_t target, uint16_t val)
+{
+    Network* net = node->net;
+    if (target >= net->nodes.size()) { return 0; }
+
+    /* a full queue pushes back on the sender, unless nobody will ever drain it */
+    Node* receiver = net->nodes[target];
+    for (int i = 0; !mbox_push(&receiver->box, val); ++i)
+    {
+        if (receiver == node || receiver->left) { return 0; }
+        if (i < MBOX_SPIN)
+        {
+            sched_yield();
+        }
+        else if (!node_block(node, receiver, val))
+        {
+            return 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+    ++node->sent;
+    net_wake(net, receiver);
+    return 1;
+}
+
+
+/* Mailbox Device */
+int mbox_read(VM* vm, uint16_t address, uint16_t* val)
+{
+    Node* node = (Node*)vm->io;
+    switch (address)
+    {
+        case MR_MBSR:
+            *val = (mbox_ready(&node->box) ? MB_READY : 0) | (node->dropped ? MB_DROPPED : 0);
+            return 1;
+        case MR_MBDR:
+            if (mem_peek(vm, MR_MBCR) & MB_WAIT)
+            {
+                *val = node_receive(node);
+            }
+            else if (!mbox_pop(&node->box, val))
+            {
+                *val = 0;
+            }
+            return 1;
+        case MR_MBID:
+            *val = node->id;
+            return 1;
+        case MR_MBNR:
+            *val = (uint16_t)node->net->nodes.size();
+            return 1;
+    }
+    return 0;
+}
+
+int mbox_write(VM* vm, uint16_t address, uint16_t val)
+{
+    Node* node = (Node*)vm->io;
+    if (address == MR_MBDR)
+    {
+        node->dropped = !node_send(node, mem_peek(vm, MR_MBTR), val);
+        node->drops += node->dropped;
+        return 1;
+    }
+    /* MBTR and MBCR are plain memory */
+    return address == MR_MBSR || address == MR_MBID || address == MR_MBNR;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    uint64_t budget = UINT64_MAX;
+    int copies = 1;
+
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-b")) { budget = strtoull(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-n")) { copies = atoi(argv[j + 1]); }
+        else { break; }
+    }
+
+    if (j >= argc || copies < 1)
+    {
+        /* show usage string */
+        printf("lc3-mbox [-b budget] [-n copies] [image-file1] ...\n");
+        exit(2);
+    }
+
+    /* one VM per image argument, the list repeated -n times */
+    std::vector<Image*> images;
+    for (; j < argc; ++j)
+    {
+        Image* image = image_alloc();
+        if (!read_image(image, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        images.push_back(image);
+    }
+
+    FILE* null_in = fopen("/dev/null", "rb");
+    Network net;
+    net.parked = 0;
+    net.deadlock = 0;
+    for (int c = 0; c < copies; ++c)
+    {
+        for (Image* image : images)
+        {
+            Node* node = new Node;
+            node->net = &net;
+            node->id = (uint16_t)net.nodes.size();
+            node->asleep = 0;
+            node->blocked_on = NULL;
+            node->left = 0;
+            node->dropped = 0;
+            node->output = NULL;
+            node->output_size = 0;
+            node->executed = node->sent = node->parks = node->drops = 0;
+            mbox_init(&node->box);
+            vm_init(&node->vm, image, null_in, open_memstream(&node->output, &node->output_size));
+            vm_attach(&node->vm, node, mbox_read, mbox_write);
+            net.nodes.push_back(node);
+        }
+    }
+    net.live = (int)net.nodes.size();
+
+    /* Run, one host thread per VM */
+    std::vector<std::thread> threads;
+    double t0 = now();
+    for (Node* node : net.nodes)
+    {
+        threads.emplace_back([node, budget]() {
+            node->executed = vm_run(&node->vm, budget);
+            net_leave(node);
+        });
+    }
+    for (std::thread& t : threads) { t.join(); }
+    double elapsed = now() - t0;
+
+    /* Report */
+    uint64_t executed = 0, sent = 0, parks = 0, drops = 0;
+    for (Node* node : net.nodes)
+    {
+        fclose(node->vm.out);
+        if (node->output_size)
+        {
+            printf("[%u] %.*s", node->id, (int)node->output_size, node->output);
+            if (node->output[node->output_size - 1] != '\n') { printf("\n"); }
+        }
+        executed += node->executed;
+        sent += node->sent;
+        parks += node->parks;
+        drops += node->drops;
+        free(node->output);
+        vm_free(&node->vm);
+    }
+
+    fprintf(stderr, "\nvms:          %zu on %u host cores\n",
+            net.nodes.size(), std::thread::hardware_concurrency());
+    fprintf(stderr, "instructions: %llu in %.3f s, %.1f MIPS\n",
+            (unsigned long long)executed, elapsed, executed / elapsed / 1e6);
+    fprintf(stderr, "messages:     %llu sent, %llu dropped, %llu parks%s\n",
+            (unsigned long long)sent, (unsigned long long)drops, (unsigned long long)parks,
+            net.deadlock ? ", stopped on deadlock" : "");
+    return net.deadlock ? 3 : 0;
+}
@@ -0,0 +1,429 @@
+/*
+ * Interactive POSIX runner for lc3-vm.h, the counterpart of lc3-alt.cpp,
+ * with store watchpoints for chasing memory corruption. Only the pages a
+ * watchpoint overlaps leave the mem_write fast path, so an unwatched run
+ * is as fast as the plain interpreter.
+ *
+ *   -w 0x4000            log every store to 0x4000
+ *   -w 0x4000-0x40FF:break  log and stop on the first store to the range
+ *   -w 0x4000:snap       log and write the memory before the store to snapshot-N.obj
+ *
+ * -f fps maps an 80x24 character framebuffer at 0xF000 (low byte of each
+ * word is the character) and routes console output through it, so a
+ * program that clears and redraws the whole screen only costs the cells
+ * that really changed. Dirty cells are tracked with a watchpoint over the
+ * framebuffer and sent as cursor moves and writes at most fps times a
+ * second, and always before the program waits for a key. The run loop
+ * looks at the clock every FB_SLICE instructions, so a program that
+ * never touches the keyboard still gets its frames.
+ *
+ * g++ -O2 lc3-run.cpp -o lc3-run
+ */
+
+#include <stdint.h> // uint16_t
+#include <stdio.h>  // FILE, fopencookie
+#include <stdlib.h> // strtoul
+#include <string.h> // strcmp
+#include <string>
+
+#include "lc3-vm.h"
+
+
+/* Watch Actions */
+enum
+{
+    WATCH_LOG = 0,
+    WATCH_BREAK,
+    WATCH_SNAP
+};
+
+enum { WATCH_MAX = 16 };
+
+Watch watches[WATCH_MAX + 1]; /* one spare for the framebuffer */
+int watch_actions[WATCH_MAX];
+int watch_count = 0;
+int snapshots = 0;
+int broke = 0;
+
+
+/* Framebuffer */
+enum
+{
+    FB_BASE = 0xF000,
+    FB_COLS = 80,
+    FB_ROWS = 24,
+    FB_CELLS = FB_COLS * FB_ROWS,
+    FB_SLICE = 1 << 16      /* instructions between frame clock checks */
+};
+
+struct Framebuffer
+{
+    VM* vm;
+    uint8_t dirty[FB_CELLS];
+    uint8_t shown[FB_CELLS];   /* what the terminal has now */
+    int any_dirty;
+    int row, col;              /* console cursor */
+    int esc;                   /* escape parser state */
+    int args[2], nargs;
+    double interval, last;
+    std::string frame;
+    uint64_t bytes_in, bytes_out, frames;
+};
+
+Framebuffer fb;
+
+int fb_hit(VM* vm, const Watch* watch, uint16_t address, uint16_t old, uint16_t val)
+{
+    (void)vm;
+    Framebuffer* f = (Framebuffer*)watch->user;
+    if (old != val)
+    {
+        f->dirty[address - FB_BASE] = 1;
+        f->any_dirty = 1;
+    }
+    return 0;
+}
+
+/* Render, changed cells only, a short gap is rewritten instead of a cursor move */
+void fb_render(Framebuffer* f)
+{
+    f->last = now();
+    if (!f->any_dirty) { return; }
+
+    f->frame.clear();
+    int cursor = -1;
+    for (int i = 0; i < FB_CELLS; ++i)
+    {
+        if (!f->dirty[i]) { continue; }
+        f->dirty[i] = 0;
+
+        uint8_t c = mem_peek(f->vm, FB_BASE + i) & 0xFF;
+        if (c < ' ' || c > '~') { c = ' '; }
+        if (c == f->shown[i]) { continue; }
+
+        if (cursor >= 0 && i > cursor && i - cursor <= 4 && i / FB_COLS == cursor / FB_COLS)
+        {
+            f->frame.append((const char*)f->shown + cursor, i - cursor);
+        }
+        else if (i != cursor)
+        {
+            char move[16];
+            snprintf(move, sizeof(move), "\x1b[%d;%dH", i / FB_COLS + 1, i % FB_COLS + 1);
+            f->frame += move;
+        }
+        f->frame += (char)c;
+        f->shown[i] = c;
+        /* the last column leaves the cursor somewhere terminal specific */
+        cursor = (i + 1) % FB_COLS ? i + 1 : -1;
+    }
+    f->any_dirty = 0;
+
+    if (!f->frame.empty())
+    {
+        fwrite(f->frame.data(), 1, f->frame.size(), stdout);
+        fflush(stdout);
+        f->bytes_out += f->frame.size();
+        ++f->frames;
+    }
+}
+
+/* Update, renders when a frame is due or right away with force */
+void fb_update(Framebuffer* f, int force)
+{
+    /* console text still sitting in the stream buffer, e.g. the IN prompt */
+    fflush(f->vm->out);
+    if (force || now() - f->last >= f->interval)
+    {
+        fb_render(f);
+    }
+}
+
+/* the keyboard is polled or read, a good moment to catch the screen up */
+int fb_read(VM* vm, uint16_t address, uint16_t* val)
+{
+    (void)val;
+    Framebuffer* f = (Framebuffer*)vm->io;
+    if (address == MR_KBSR || address == MR_KBDR)
+    {
+        fb_update(f, address == MR_KBDR);
+    }
+    return 0;
+}
+
+/* Console, the subset of a terminal the games use, drawn into the framebuffer */
+void fb_newline(Framebuffer* f)
+{
+    f->col = 0;
+    if (++f->row < FB_ROWS) { return; }
+
+    f->row = FB_ROWS - 1;
+    for (int i = 0; i < FB_CELLS - FB_COLS; ++i)
+    {
+        mem_write(f->vm, FB_BASE + i, mem_peek(f->vm, FB_BASE + i + FB_COLS));
+    }
+    for (int i = FB_CELLS - FB_COLS; i < FB_CELLS; ++i)
+    {
+        mem_write(f->vm, FB_BASE + i, ' ');
+    }
+}
+
+void fb_escape(Framebuffer* f, char final)
+{
+    switch (final)
+    {
+        case 'J': /* 2J clears the screen, 3J the scrollback */
+            if (f->args[0] == 2)
+            {
+                for (int i = 0; i < FB_CELLS; ++i) { mem_write(f->vm, FB_BASE + i, ' '); }
+            }
+            break;
+        case 'K': /* clear to the end of the line */
+            for (int c = f->col; c < FB_COLS; ++c)
+            {
+                mem_write(f->vm, FB_BASE + f->row * FB_COLS + c, ' ');
+            }
+            break;
+        case 'H':
+        case 'f':
+            f->row = f->args[0] > 0 ? f->args[0] - 1 : 0;
+            f->col = f->args[1] > 0 ? f->args[1] - 1 : 0;
+            if (f->row >= FB_ROWS) { f->row = FB_ROWS - 1; }
+            if (f->col >= FB_COLS) { f->col = FB_COLS - 1; }
+            break;
+    }
+}
+
+void fb_putc(Framebuffer* f, char c)
+{
+    if (f->esc == 1)
+    {
+        f->esc = c == '[' ? 2 : 0;
+        f->args[0] = f->args[1] = 0;
+        f->nargs = 0;
+        return;
+    }
+    if (f->esc == 2)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            if (f->nargs < 2) { f->args[f->nargs] = f->args[f->nargs] * 10 + (c - '0'); }
+        }
+        else if (c == ';')
+        {
+            ++f->nargs;
+        }
+        else
+        {
+            fb_escape(f, c);
+            f->esc = 0;
+        }
+        return;
+    }
+
+    switch (c)
+    {
+        case '\x1b': f->esc = 1; break;
+        case '\n': fb_newline(f); break;
+        case '\r': f->col = 0; break;
+        case '\b': if (f->col) { --f->col; } break;
+        default:
+            mem_write(f->vm, FB_BASE + f->row * FB_COLS + f->col, (uint8_t)c);
+            if (++f->col == FB_COLS) { fb_newline(f); }
+            break;
+    }
+}
+
+ssize_t fb_console_write(void* cookie, const char* buf, size_t size)
+{
+    Framebuffer* f = (Framebuffer*)cookie;
+    for (size_t i = 0; i < size; ++i)
+    {
+        fb_putc(f, buf[i]);
+    }
+    f->bytes_in += size;
+    return size;
+}
+
+FILE* fb_open(Framebuffer* f, VM* vm, int fps)
+{
+    memset(f->dirty, 0, sizeof(f->dirty));
+    memset(f->shown, ' ', sizeof(f->shown));
+    f->vm = vm;
+    f->any_dirty = 0;
+    f->row = f->col = 0;
+    f->esc = 0;
+    f->interval = 1.0 / fps;
+    f->last = 0;
+    f->bytes_in = f->bytes_out = f->frames = 0;
+
+    /* start from a blank screen that matches shown */
+    for (int i = 0; i < FB_CELLS; ++i) { mem_write(vm, FB_BASE + i, ' '); }
+    fputs("\x1b[2J\x1b[H", stdout);
+    fflush(stdout);
+
+    cookie_io_functions_t io = { NULL, fb_console_write, NULL, NULL };
+    return fopencookie(f, "w", io);
+}
+
+
+/* Write Image File, the whole memory at origin 0 so it loads back as is */
+int write_image(const VM* vm, const char* image_path)
+{
+    FILE* file = fopen(image_path, "wb");
+    if (!file) { return 0; }
+
+    uint16_t word = swap16(0x0000);
+    fwrite(&word, sizeof(word), 1, file);
+    for (uint32_t a = 0; a < (1 << 16); ++a)
+    {
+        word = swap16(mem_peek(vm, a));
+        fwrite(&word, sizeof(word), 1, file);
+    }
+    fclose(file);
+    return 1;
+}
+
+int watch_hit(VM* vm, const Watch* watch, uint16_t address, uint16_t old, uint16_t val)
+{
+    int action = *(const int*)watch->user;
+    fprintf(stderr, "\r\nwatch %04X: %04X -> %04X at pc %04X\r\n",
+            address, old, val, (uint16_t)(vm->reg[R_PC] - 1));
+
+    if (action == WATCH_SNAP)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "snapshot-%d.obj", snapshots++);
+        if (write_image(vm, path)) { fprintf(stderr, "wrote %s\r\n", path); }
+    }
+    if (action == WATCH_BREAK)
+    {
+        broke = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Parse Watch, lo[-hi][:log|break|snap] */
+int parse_watch(const char* arg)
+{
+    if (watch_count == WATCH_MAX) { return 0; }
+
+    char* end;
+    unsigned long lo = strtoul(arg, &end, 0);
+    unsigned long hi = lo;
+    if (*end == '-') { hi = strtoul(end + 1, &end, 0); }
+
+    int action = WATCH_LOG;
+    if (*end == ':')
+    {
+        if (!strcmp(end + 1, "log")) { action = WATCH_LOG; }
+        else if (!strcmp(end + 1, "break")) { action = WATCH_BREAK; }
+        else if (!strcmp(end + 1, "snap")) { action = WATCH_SNAP; }
+        else { return 0; }
+    }
+    else if (*end)
+    {
+        return 0;
+    }
+    if (hi < lo || hi > 0xFFFF) { return 0; }
+
+    watch_actions[watch_count] = action;
+    Watch& w = watches[watch_count];
+    w.lo = (uint16_t)lo;
+    w.hi = (uint16_t)hi;
+    w.hit = watch_hit;
+    w.user = &watch_actions[watch_count];
+    ++watch_count;
+    return 1;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    int fps = 0;
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-f"))
+        {
+            fps = atoi(argv[j + 1]);
+        }
+        else if (strcmp(argv[j], "-w") || !parse_watch(argv[j + 1]))
+        {
+            printf("bad option: %s %s\n", argv[j], argv[j + 1]);
+            exit(2);
+        }
+    }
+
+    if (j >= argc || fps < 0)
+    {
+        /* show usage string */
+        printf("lc3-run [-f fps] [-w lo[-hi][:log|break|snap]] ... [image-file1] ...\n");
+        exit(2);
+    }
+
+    Image* image = image_alloc();
+    for (; j < argc; ++j)
+    {
+        if (!read_image(image, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+
+    /* Setup */
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+
+    VM vm;
+    vm_init(&vm, image, stdin, stdout);
+    if (fps)
+    {
+        vm.out = fb_open(&fb, &vm, fps);
+        vm_attach(&vm, &fb, fb_read, NULL);
+
+        Watch& w = watches[watch_count++];
+        w.lo = FB_BASE;
+        w.hi = FB_BASE + FB_CELLS - 1;
+        w.hit = fb_hit;
+        w.user = &fb;
+    }
+    vm_watch(&vm, watches, watch_count);
+
+    /* in slices with -f, so frames go out while the program draws */
+    while (vm.running)
+    {
+        vm_run(&vm, fps ? FB_SLICE : UINT64_MAX);
+        if (fps) { fb_update(&fb, 0); }
+    }
+
+    /* Shutdown */
+    if (fps)
+    {
+        fflush(vm.out);
+        fb_render(&fb);
+        fclose(vm.out);
+        printf("\x1b[%d;1H", FB_ROWS + 1);
+        fflush(stdout);
+    }
+    restore_input_buffering();
+    if (fps)
+    {
+        fprintf(stderr, "framebuffer: %llu bytes printed, %llu sent to the terminal in %llu frames\n",
+                (unsigned long long)fb.bytes_in, (unsigned long long)fb.bytes_out,
+                (unsigned long long)fb.frames);
+    }
+    if (broke)
+    {
+        fprintf(stderr, "R0 %04X  R1 %04X  R2 %04X  R3 %04X\n",
+                vm.reg[R_R0], vm.reg[R_R1], vm.reg[R_R2], vm.reg[R_R3]);
+        fprintf(stderr, "R4 %04X  R5 %04X  R6 %04X  R7 %04X\n",
+                vm.reg[R_R4], vm.reg[R_R5], vm.reg[R_R6], vm.reg[R_R7]);
+        fprintf(stderr, "PC %04X  COND %X\n", vm.reg[R_PC], vm.reg[R_COND]);
+    }
+    vm_free(&vm);
+    free(image);
+    return broke ? 3 : 0;
+}
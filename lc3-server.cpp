@@ -0,0 +1,597 @@
+/*
+ * Persistent VM server. Keeps the images loaded and a pool of reset-ready
+ * VMs per image, and runs jobs sent over a Unix domain socket on a set of
+ * worker threads, so a short program costs a vm_reset instead of an exec,
+ * a read_image and a console setup.
+ *
+ * Requests, one or more per connection:
+ *   RUN <image-id> <budget> <input-length>\n<input bytes>
+ *     -> OK <instructions> <halted> <usec> <output-length>\n<output bytes>
+ *     -> ERR <message>\n
+ *   STATS\n
+ *     -> STATS <jobs> <p50-usec> <p99-usec>\n
+ *
+ * Every request is its own job. The main thread polls the idle
+ * connections and hands one with a request waiting to the next free
+ * worker, so the jobs of one connection run one at a time but spread over
+ * the workers, and an idle client only costs a pollfd. A client that
+ * stalls in the middle of a request is dropped after IO_TIMEOUT seconds.
+ * Job latency (usec, p50, p99) runs from when poll sees the request until
+ * its reply is ready, so time spent waiting for a free worker counts too.
+ *
+ * lc3-server [-s socket] [-t threads] [-p pool] [-b budget] id=image.obj ...
+ * lc3-server -c socket id [budget] < input
+ * lc3-server -c socket stats
+ *
+ * g++ -O2 -pthread lc3-server.cpp -o lc3-server
+ */
+
+#include <stdint.h>     // uint16_t
+#include <stdio.h>      // FILE
+#include <stdlib.h>     // strtoull
+#include <string.h>     // strcmp
+#include <poll.h>       // poll
+#include <sys/socket.h> // socket
+#include <sys/un.h>     // sockaddr_un
+#include <fcntl.h>      // fcntl
+#include <unistd.h>     // close
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lc3-vm.h"
+
+enum
+{
+    MAX_INPUT = 1 << 24,      /* bytes per job */
+    LATENCY_SAMPLES = 100000, /* most recent jobs kept for percentiles */
+    IO_TIMEOUT = 5            /* seconds a worker waits on a stalled client */
+};
+
+
+/* Program: one preloaded image and its pool of idle VMs */
+struct Program
+{
+    std::string id;
+    Image* image;
+    std::mutex lock;
+    std::vector<VM*> idle;
+};
+
+std::vector<Program*> programs;
+uint64_t default_budget = 100000000;
+FILE* null_in;
+
+/* Connection: the socket plus our own read buffer, so we can tell when
+   the next request has already arrived */
+struct Connection
+{
+    int fd;
+    FILE* tx;
+    double arrived;   /* when the waiting request was seen, latency counts from here */
+    size_t start, end;
+    char buf[4096];
+};
+
+/* Connection Queues, ready for a worker and done with one */
+std::mutex queue_lock;
+std::condition_variable queue_ready;
+std::deque<Connection*> queue;
+std::vector<Connection*> returned;
+int wake_fds[2];
+
+/* Latency */
+std::mutex latency_lock;
+std::vector<uint32_t> latency;
+uint64_t jobs_done = 0;
+
+volatile sig_atomic_t stopping = 0;
+
+
+/* Pool */
+VM* pool_take(Program* program)
+{
+    {
+        std::lock_guard<std::mutex> guard(program->lock);
+        if (!program->idle.empty())
+        {
+            VM* vm = program->idle.back();
+            program->idle.pop_back();
+            return vm;
+        }
+    }
+    VM* vm = (VM*)malloc(sizeof(VM));
+    if (!vm) { abort(); }
+    vm_init(vm, program->image, null_in, NULL);
+    return vm;
+}
+
+/* reset before it goes back, so the next job starts right away */
+void pool_give(Program* program, VM* vm)
+{
+    vm_reset(vm);
+    std::lock_guard<std::mutex> guard(program->lock);
+    program->idle.push_back(vm);
+}
+
+Program* find_program(const char* id)
+{
+    for (Program* program : programs)
+    {
+        if (program->id == id) { return program; }
+    }
+    return NULL;
+}
+
+/* Latency Stats */
+void record_latency(uint32_t usec)
+{
+    std::lock_guard<std::mutex> guard(latency_lock);
+    if (latency.size() < LATENCY_SAMPLES)
+    {
+        latency.push_back(usec);
+    }
+    else
+    {
+        latency[jobs_done % LATENCY_SAMPLES] = usec;
+    }
+    ++jobs_done;
+}
+
+void latency_percentiles(uint64_t* jobs, uint32_t* p50, uint32_t* p99)
+{
+    std::vector<uint32_t> samples;
+    {
+        std::lock_guard<std::mutex> guard(latency_lock);
+        samples = latency;
+        *jobs = jobs_done;
+    }
+    *p50 = *p99 = 0;
+    if (samples.empty()) { return; }
+
+    size_t i50 = samples.size() / 2;
+    size_t i99 = samples.size() * 99 / 100;
+    std::nth_element(samples.begin(), samples.begin() + i50, samples.end());
+    *p50 = samples[i50];
+    std::nth_element(samples.begin(), samples.begin() + i99, samples.end());
+    *p99 = samples[i99];
+}
+
+
+/* Connection Input */
+int conn_fill(Connection* c)
+{
+    ssize_t n = read(c->fd, c->buf, sizeof(c->buf));
+    if (n <= 0) { return 0; } /* closed, failed or timed out */
+    c->start = 0;
+    c->end = (size_t)n;
+    return 1;
+}
+
+int conn_line(Connection* c, char* line, size_t size)
+{
+    size_t n = 0;
+    for (;;)
+    {
+        while (c->start < c->end)
+        {
+            char ch = c->buf[c->start++];
+            if (ch == '\n')
+            {
+                line[n] = '\0';
+                return 1;
+            }
+            if (n + 1 >= size) { return 0; }
+            line[n++] = ch;
+        }
+        if (!conn_fill(c)) { return 0; }
+    }
+}
+
+int conn_read(Connection* c, char* data, size_t size)
+{
+    size_t have = std::min(size, c->end - c->start);
+    memcpy(data, c->buf + c->start, have);
+    c->start += have;
+    while (have < size)
+    {
+        ssize_t n = read(c->fd, data + have, size - have);
+        if (n <= 0) { return 0; }
+        have += (size_t)n;
+    }
+    return 1;
+}
+
+
+/* Run Job, returns 0 when the connection can't carry on */
+int run_job(Connection* c, const char* id, uint64_t budget, size_t input_size)
+{
+    FILE* tx = c->tx;
+    if (input_size > MAX_INPUT)
+    {
+        /* the input is still on its way, don't parse it as requests */
+        fprintf(tx, "ERR input too large\n");
+        return 0;
+    }
+    std::vector<char> input(input_size);
+    if (input_size && !conn_read(c, input.data(), input_size))
+    {
+        return 0;
+    }
+
+    Program* program = find_program(id);
+    if (!program)
+    {
+        fprintf(tx, "ERR unknown image %s\n", id);
+        return 1;
+    }
+
+    VM* vm = pool_take(program);
+
+    char* output = NULL;
+    size_t output_size = 0;
+    vm->in = input_size ? fmemopen(input.data(), input_size, "r") : null_in;
+    vm->out = open_memstream(&output, &output_size);
+
+    uint64_t executed = vm_run(vm, budget ? budget : default_budget);
+    int halted = !vm->running;
+
+    if (vm->in != null_in) { fclose(vm->in); }
+    fclose(vm->out);
+    vm->in = null_in;
+    vm->out = NULL;
+    pool_give(program, vm);
+
+    uint32_t usec = (uint32_t)((now() - c->arrived) * 1e6);
+    record_latency(usec);
+
+    fprintf(tx, "OK %llu %d %u %zu\n", (unsigned long long)executed, halted, usec, output_size);
+    fwrite(output, 1, output_size, tx);
+    free(output);
+    return 1;
+}
+
+/* Serve one request, returns 0 when the connection should be closed */
+int serve(Connection* c)
+{
+    char line[512];
+    char command[16];
+    if (!conn_line(c, line, sizeof(line))) { return 0; }
+    if (sscanf(line, "%15s", command) != 1) { return 1; }
+
+    FILE* tx = c->tx;
+    int keep = 1;
+    if (!strcmp(command, "RUN"))
+    {
+        char id[256];
+        unsigned long long budget;
+        size_t input_size;
+        if (sscanf(line, "RUN %255s %llu %zu", id, &budget, &input_size) != 3)
+        {
+            fprintf(tx, "ERR bad request\n");
+            keep = 0;
+        }
+        else
+        {
+            keep = run_job(c, id, budget, input_size);
+        }
+    }
+    else if (!strcmp(command, "STATS"))
+    {
+        uint64_t jobs;
+        uint32_t p50, p99;
+        latency_percentiles(&jobs, &p50, &p99);
+        fprintf(tx, "STATS %llu %u %u\n", (unsigned long long)jobs, p50, p99);
+    }
+    else
+    {
+        fprintf(tx, "ERR bad request\n");
+        keep = 0;
+    }
+    return fflush(tx) == 0 && keep;
+}
+
+void close_connection(Connection* c)
+{
+    fclose(c->tx);
+    close(c->fd);
+    delete c;
+}
+
+void worker()
+{
+    for (;;)
+    {
+        Connection* c;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_ready.wait(guard, []() { return !queue.empty(); });
+            c = queue.front();
+            queue.pop_front();
+        }
+
+        /* requests that already arrived don't need another trip through poll */
+        int keep;
+        do
+        {
+            keep = serve(c);
+            /* a pipelined request only gets its turn now */
+            c->arrived = now();
+        } while (keep && c->start < c->end);
+
+        if (!keep)
+        {
+            close_connection(c);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            returned.push_back(c);
+        }
+        char wake = 0;
+        if (write(wake_fds[1], &wake, 1) < 0) { /* the pipe is full, poll wakes anyway */ }
+    }
+}
+
+
+/* Socket */
+int open_socket(const char* path, struct sockaddr_un* addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(addr->sun_path)) { return -1; }
+    strcpy(addr->sun_path, path);
+    return fd;
+}
+
+void handle_stop(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+int run_server(const char* path, int threads, int pool)
+{
+    for (Program* program : programs)
+    {
+        for (int i = 0; i < pool; ++i)
+        {
+            VM* vm = (VM*)malloc(sizeof(VM));
+            if (!vm) { abort(); }
+            vm_init(vm, program->image, null_in, NULL);
+            program->idle.push_back(vm);
+        }
+    }
+
+    struct sockaddr_un addr;
+    int listener = open_socket(path, &addr);
+    unlink(path);
+    if (listener < 0
+        || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(listener, 64) < 0)
+    {
+        printf("failed to listen on: %s\n", path);
+        return 1;
+    }
+
+    /* no SA_RESTART, so a signal breaks us out of poll */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(wake_fds) < 0) { abort(); }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    for (int t = 0; t < threads; ++t)
+    {
+        std::thread(worker).detach();
+    }
+    fprintf(stderr, "lc3-server: %zu images, %d threads, listening on %s\n",
+            programs.size(), threads, path);
+
+    /* Poll: idle connections wait here, not on a worker */
+    struct timeval timeout = { IO_TIMEOUT, 0 };
+    std::vector<Connection*> idle;
+    std::vector<struct pollfd> fds;
+    while (!stopping)
+    {
+        fds.clear();
+        fds.push_back({ wake_fds[0], POLLIN, 0 });
+        fds.push_back({ listener, POLLIN, 0 });
+        for (Connection* c : idle)
+        {
+            fds.push_back({ c->fd, POLLIN, 0 });
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) { continue; }
+        double polled = now();
+
+        /* drain before taking back the returned connections, a worker that
+           returns one after this leaves a byte for the next poll */
+        if (fds[0].revents)
+        {
+            char drain[64];
+            while (read(wake_fds[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        /* hand the ones with a request (or a hangup) to the workers */
+        std::vector<Connection*> still_idle;
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            for (size_t i = 0; i < idle.size(); ++i)
+            {
+                if (fds[i + 2].revents)
+                {
+                    idle[i]->arrived = polled;
+                    queue.push_back(idle[i]);
+                    queue_ready.notify_one();
+                }
+                else
+                {
+                    still_idle.push_back(idle[i]);
+                }
+            }
+            still_idle.insert(still_idle.end(), returned.begin(), returned.end());
+            returned.clear();
+        }
+        idle.swap(still_idle);
+
+        if (fds[1].revents)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0) { continue; }
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            Connection* c = new Connection;
+            c->fd = fd;
+            c->tx = fdopen(dup(fd), "w");
+            c->arrived = now();
+            c->start = c->end = 0;
+            if (!c->tx) { abort(); }
+            idle.push_back(c);
+        }
+    }
+
+    /* Shutdown */
+    close(listener);
+    unlink(path);
+
+    uint64_t jobs;
+    uint32_t p50, p99;
+    latency_percentiles(&jobs, &p50, &p99);
+    fprintf(stderr, "\nlc3-server: %llu jobs, p50 %u us, p99 %u us\n",
+            (unsigned long long)jobs, p50, p99);
+    return 0;
+}
+
+
+/* Client */
+int run_client(const char* path, const char* id, uint64_t budget)
+{
+    struct sockaddr_un addr;
+    int fd = open_socket(path, &addr);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        printf("failed to connect to: %s\n", path);
+        return 1;
+    }
+    FILE* rx = fdopen(fd, "r");
+    FILE* tx = fdopen(dup(fd), "w");
+
+    if (!strcmp(id, "stats"))
+    {
+        fprintf(tx, "STATS\n");
+        fflush(tx);
+
+        unsigned long long jobs;
+        unsigned p50, p99;
+        if (fscanf(rx, "STATS %llu %u %u", &jobs, &p50, &p99) != 3) { return 1; }
+        printf("jobs: %llu  p50: %u us  p99: %u us\n", jobs, p50, p99);
+        return 0;
+    }
+
+    std::vector<char> input;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    {
+        input.insert(input.end(), buf, buf + n);
+    }
+
+    fprintf(tx, "RUN %s %llu %zu\n", id, (unsigned long long)budget, input.size());
+    fwrite(input.data(), 1, input.size(), tx);
+    fflush(tx);
+
+    unsigned long long executed;
+    int halted;
+    unsigned usec;
+    size_t output_size;
+    char status[8];
+    if (fscanf(rx, "%7s", status) != 1) { return 1; }
+    if (strcmp(status, "OK"))
+    {
+        char message[256] = "";
+        if (fgets(message, sizeof(message), rx)) { fprintf(stderr, "lc3-server:%s", message); }
+        return 1;
+    }
+    if (fscanf(rx, "%llu %d %u %zu", &executed, &halted, &usec, &output_size) != 4
+        || fgetc(rx) != '\n')
+    {
+        return 1;
+    }
+
+    while (output_size > 0 && (n = fread(buf, 1, std::min(output_size, sizeof(buf)), rx)) > 0)
+    {
+        fwrite(buf, 1, n, stdout);
+        output_size -= n;
+    }
+    fprintf(stderr, "%llu instructions, %s, %u us\n", executed, halted ? "halted" : "budget", usec);
+    return 0;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    const char* path = "/tmp/lc3.sock";
+    int threads = std::thread::hardware_concurrency();
+    int pool = 4;
+
+    if (argc >= 4 && !strcmp(argv[1], "-c"))
+    {
+        uint64_t budget = argc >= 5 ? strtoull(argv[4], NULL, 0) : 0;
+        return run_client(argv[2], argv[3], budget);
+    }
+
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-s")) { path = argv[j + 1]; }
+        else if (!strcmp(argv[j], "-t")) { threads = atoi(argv[j + 1]); }
+        else if (!strcmp(argv[j], "-p")) { pool = atoi(argv[j + 1]); }
+        else if (!strcmp(argv[j], "-b")) { default_budget = strtoull(argv[j + 1], NULL, 0); }
+        else { break; }
+    }
+
+    if (j >= argc)
+    {
+        /* show usage string */
+        printf("lc3-server [-s socket] [-t threads] [-p pool] [-b budget] [id=image-file1] ...\n");
+        printf("lc3-server -c socket id [budget] < input\n");
+        printf("lc3-server -c socket stats\n");
+        exit(2);
+    }
+    if (threads < 1) { threads = 1; }
+
+    null_in = fopen("/dev/null", "rb");
+    for (; j < argc; ++j)
+    {
+        /* id=path, or the path doubles as the id */
+        const char* eq = strchr(argv[j], '=');
+        Program* program = new Program;
+        program->id = eq ? std::string(argv[j], eq - argv[j]) : std::string(argv[j]);
+        program->image = image_alloc();
+        if (!read_image(program->image, eq ? eq + 1 : argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        programs.push_back(program);
+    }
+
+    /* the workers are still parked on the queue, so skip the static
+       destructors (destroying queue_ready would wait for them) */
+    int status = run_server(path, threads, pool);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
@@ -0,0 +1,519 @@
+/*
+ * Lockstep batch engine, runs LANES copies of one program on different
+ * inputs with the registers in struct-of-arrays form, one vector lane per
+ * instance. Every step issues the instruction at the lowest PC among the
+ * live lanes for all lanes sitting at that PC and masks the rest out, so
+ * lanes whose control flow diverged wait for each other to reconverge.
+ *
+ * The same jobs are then run with the scalar lc3-vm.h interpreter on
+ * every core to compare aggregate MIPS and check that outputs agree.
+ *
+ * g++ -O3 -mavx2 -pthread lc3-simd.cpp -o lc3-simd
+ * g++ -O3 -mavx512bw -DLC3_LANES=32 -pthread lc3-simd.cpp -o lc3-simd
+ */
+
+#include <stdint.h> // uint16_t
+#include <stdio.h>  // FILE
+#include <stdlib.h> // strtoull
+#include <string.h> // strcmp
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "lc3-vm.h"
+
+#ifndef LC3_LANES
+#define LC3_LANES 16 /* 16 x 16 bits fills an AVX2 register */
+#endif
+
+enum { LANES = LC3_LANES };
+
+typedef uint16_t lanes_t __attribute__((vector_size(LANES * sizeof(uint16_t))));
+typedef int16_t slanes_t __attribute__((vector_size(LANES * sizeof(int16_t))));
+typedef uint32_t counts_t __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+
+/* Batch */
+struct Batch
+{
+    lanes_t reg[R_COUNT];   /* reg[r][lane] */
+    lanes_t* memory;        /* memory[address][lane], same address is one vector load */
+    lanes_t live;           /* 0xFFFF for lanes still running */
+    counts_t executed;      /* instructions per lane */
+    uint32_t budget;
+    FILE* in[LANES];
+    FILE* out[LANES];
+    uint64_t steps;         /* vector instructions issued */
+    uint64_t lane_steps;    /* lanes that did work in them */
+};
+
+/* Job: one program run on one input */
+struct Job
+{
+    const char* input;
+    size_t input_size;
+    char* output;
+    size_t output_size;
+    uint64_t executed;
+};
+
+
+/* Lane Helpers */
+inline lanes_t splat(uint16_t x)
+{
+    lanes_t v = {};
+    return v + x;
+}
+
+inline lanes_t blend(lanes_t m, lanes_t a, lanes_t b)
+{
+    return (a & m) | (b & ~m);
+}
+
+inline lanes_t flags_of(lanes_t v)
+{
+    lanes_t zero = (lanes_t)(v == 0);
+    lanes_t neg = (lanes_t)((slanes_t)v < 0);
+    return (zero & splat(FL_ZRO)) | (neg & splat(FL_NEG)) | (~(zero | neg) & splat(FL_POS));
+}
+
+/* Lane Memory Access */
+inline uint16_t lane_read(Batch* b, int l, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        if (check_key(b->in[l]))
+        {
+            b->memory[MR_KBSR][l] = (1 << 15);
+            b->memory[MR_KBDR][l] = getc(b->in[l]);
+        }
+        else
+        {
+            b->memory[MR_KBSR][l] = 0;
+        }
+    }
+    return b->memory[address][l];
+}
+
+/* same address on every lane, a plain vector load */
+inline lanes_t batch_load(Batch* b, lanes_t m, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            if (m[l]) { lane_read(b, l, address); }
+        }
+    }
+    return b->memory[address];
+}
+
+/* per lane addresses, gathered one lane at a time */
+inline lanes_t batch_gather(Batch* b, lanes_t m, lanes_t address)
+{
+    lanes_t v = {};
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (m[l]) { v[l] = lane_read(b, l, address[l]); }
+    }
+    return v;
+}
+
+inline void batch_store(Batch* b, lanes_t m, uint16_t address, lanes_t val)
+{
+    b->memory[address] = blend(m, val, b->memory[address]);
+}
+
+inline void batch_scatter(Batch* b, lanes_t m, lanes_t address, lanes_t val)
+{
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (m[l]) { b->memory[address[l]][l] = val[l]; }
+    }
+}
+
+/* Lane Trap, the I/O routines stay scalar */
+void lane_trap(Batch* b, int l, uint16_t trapvect)
+{
+    FILE* in = b->in[l];
+    FILE* out = b->out[l];
+    switch (trapvect)
+    {
+        case TRAP_GETC:
+            b->reg[R_R0][l] = (uint16_t)getc(in);
+            break;
+        case TRAP_OUT:
+            putc((char)b->reg[R_R0][l], out);
+            break;
+        case TRAP_PUTS:
+            {
+                uint16_t a = b->reg[R_R0][l];
+                uint16_t c;
+                while ((c = b->memory[a++][l]))
+                {
+                    putc((char)c, out);
+                }
+            }
+            break;
+        case TRAP_IN:
+            {
+                fprintf(out, "Enter a character: ");
+                char c = getc(in);
+                putc(c, out);
+                b->reg[R_R0][l] = (uint16_t)c;
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                uint16_t a = b->reg[R_R0][l];
+                uint16_t c;
+                while ((c = b->memory[a++][l]))
+                {
+                    putc((char)(c & 0xFF), out);
+                    char char2 = c >> 8;
+                    if (char2) putc(char2, out);
+                }
+            }
+            break;
+        case TRAP_HALT:
+            fputs("HALT\n", out);
+            b->live[l] = 0;
+            break;
+    }
+}
+
+
+/* Batch Instruction, ins<op> for every lane in m, pc is already incremented */
+template <unsigned op>
+void bins(Batch* b, lanes_t m, uint16_t instr, uint16_t pc)
+{
+    lanes_t* reg = b->reg;
+    uint16_t r0, r1, r2, imm5, imm_flag;
+    uint16_t pc_plus_off;
+    lanes_t base_plus_off;
+
+    constexpr uint16_t opbit = (1 << op);
+    if (0x4EEE & opbit) { r0 = (instr >> 9) & 0x7; }
+    if (0x12F3 & opbit) { r1 = (instr >> 6) & 0x7; }
+    if (0x0022 & opbit)
+    {
+        imm_flag = (instr >> 5) & 0x1;
+
+        if (imm_flag)
+        {
+            imm5 = sign_extend(instr & 0x1F, 5);
+        }
+        else
+        {
+            r2 = instr & 0x7;
+        }
+    }
+    if (0x00C0 & opbit)
+    {   // Base + offset
+        base_plus_off = reg[r1] + sign_extend(instr & 0x3F, 6);
+    }
+    if (0x4C0D & opbit)
+    {
+        // Indirect address, uniform since every lane in m shares the pc
+        pc_plus_off = pc + sign_extend(instr & 0x1FF, 9);
+    }
+    if (0x0001 & opbit)
+    {
+        // BR, the only place lanes split up
+        uint16_t cond = (instr >> 9) & 0x7;
+        lanes_t taken = m & (lanes_t)((reg[R_COND] & cond) != 0);
+        reg[R_PC] = blend(taken, splat(pc_plus_off), reg[R_PC]);
+    }
+    if (0x0002 & opbit)  // ADD
+    {
+        lanes_t v = imm_flag ? reg[r1] + imm5 : reg[r1] + reg[r2];
+        reg[r0] = blend(m, v, reg[r0]);
+    }
+    if (0x0020 & opbit)  // AND
+    {
+        lanes_t v = imm_flag ? reg[r1] & imm5 : reg[r1] & reg[r2];
+        reg[r0] = blend(m, v, reg[r0]);
+    }
+    if (0x0200 & opbit) { reg[r0] = blend(m, ~reg[r1], reg[r0]); } // NOT
+    if (0x1000 & opbit) { reg[R_PC] = blend(m, reg[r1], reg[R_PC]); } // JMP
+    if (0x0010 & opbit)  // JSR
+    {
+        uint16_t long_flag = (instr >> 11) & 1;
+        lanes_t target = long_flag ? splat(pc + sign_extend(instr & 0x7FF, 11)) : reg[r1];
+        reg[R_R7] = blend(m, splat(pc), reg[R_R7]);
+        reg[R_PC] = blend(m, target, reg[R_PC]);
+    }
+
+    if (0x0004 & opbit) { reg[r0] = blend(m, batch_load(b, m, pc_plus_off), reg[r0]); } // LD
+    if (0x0400 & opbit) // LDI
+    {
+        lanes_t address = batch_load(b, m, pc_plus_off);
+        reg[r0] = blend(m, batch_gather(b, m, address), reg[r0]);
+    }
+    if (0x0040 & opbit) { reg[r0] = blend(m, batch_gather(b, m, base_plus_off), reg[r0]); } // LDR
+    if (0x4000 & opbit) { reg[r0] = blend(m, splat(pc_plus_off), reg[r0]); } // LEA
+    if (0x0008 & opbit) { batch_store(b, m, pc_plus_off, reg[r0]); } // ST
+    if (0x0800 & opbit) { batch_scatter(b, m, batch_load(b, m, pc_plus_off), reg[r0]); } // STI
+    if (0x0080 & opbit) { batch_scatter(b, m, base_plus_off, reg[r0]); } // STR
+    if (0x8000 & opbit)  // TRAP
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            if (m[l]) { lane_trap(b, l, instr & 0xFF); }
+        }
+    }
+    if (0x4666 & opbit) { reg[R_COND] = blend(m, flags_of(reg[r0]), reg[R_COND]); }
+}
+
+/* RTI and the reserved opcode retire the lanes that hit them */
+void bins_bad(Batch* b, lanes_t m, uint16_t instr, uint16_t pc)
+{
+    (void)instr;
+    (void)pc;
+    b->live &= ~m;
+}
+
+/* Batch Op Table */
+static void (*const batch_op_table[16])(Batch*, lanes_t, uint16_t, uint16_t) = {
+    bins<0>, bins<1>, bins<2>, bins<3>,
+    bins<4>, bins<5>, bins<6>, bins<7>,
+    bins_bad, bins<9>, bins<10>, bins<11>,
+    bins<12>, bins_bad, bins<14>, bins<15>
+};
+
+/* Batch Step, returns 0 once every lane has retired */
+int batch_step(Batch* b)
+{
+    /* the lowest pc goes first: lanes that went ahead wait there until
+       the stragglers catch up, which regroups them after an if/else */
+    uint16_t pc = 0xFFFF;
+    int lead = -1;
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (b->live[l] && (lead < 0 || b->reg[R_PC][l] < pc))
+        {
+            pc = b->reg[R_PC][l];
+            lead = l;
+        }
+    }
+    if (lead < 0) { return 0; }
+
+    /* lanes that rewrote this word run it on a later step */
+    uint16_t instr = b->memory[pc][lead];
+    lanes_t m = b->live
+              & (lanes_t)(b->reg[R_PC] == pc)
+              & (lanes_t)(b->memory[pc] == instr);
+
+    b->reg[R_PC] = blend(m, splat(pc + 1), b->reg[R_PC]);
+    batch_op_table[instr >> 12](b, m, instr, pc + 1);
+
+    counts_t ran = __builtin_convertvector(m, counts_t) & 1;
+    b->executed += ran;
+    b->live &= (lanes_t)__builtin_convertvector(b->executed < b->budget, slanes_t);
+    b->steps += 1;
+    for (int l = 0; l < LANES; ++l)
+    {
+        b->lane_steps += ran[l];
+    }
+    return 1;
+}
+
+
+/* Input/Output Streams */
+FILE* open_input(const Job* job, FILE* null_in)
+{
+    if (!job->input_size) { return null_in; }
+    return fmemopen((void*)job->input, job->input_size, "r");
+}
+
+/* Run Batch, jobs[0..count) with count <= LANES */
+void run_batch(const Image* image, Job* jobs, int count, uint32_t budget,
+               FILE* null_in, uint64_t* steps, uint64_t* lane_steps)
+{
+    Batch b;
+    b.memory = (lanes_t*)aligned_alloc(sizeof(lanes_t), (1 << 16) * sizeof(lanes_t));
+    if (!b.memory) { abort(); }
+    for (int a = 0; a < (1 << 16); ++a)
+    {
+        b.memory[a] = splat(image->memory[a]);
+    }
+    for (int r = 0; r < R_COUNT; ++r)
+    {
+        b.reg[r] = splat(image->reg[r]);
+    }
+
+    b.live = splat(0);
+    b.executed = __builtin_convertvector(splat(0), counts_t);
+    b.budget = budget;
+    b.steps = 0;
+    b.lane_steps = 0;
+    for (int l = 0; l < LANES; ++l)
+    {
+        b.in[l] = NULL;
+        b.out[l] = NULL;
+        if (l < count)
+        {
+            b.live[l] = 0xFFFF;
+            b.in[l] = open_input(&jobs[l], null_in);
+            b.out[l] = open_memstream(&jobs[l].output, &jobs[l].output_size);
+        }
+    }
+
+    while (batch_step(&b)) {}
+
+    for (int l = 0; l < count; ++l)
+    {
+        jobs[l].executed = b.executed[l];
+        if (b.in[l] != null_in) { fclose(b.in[l]); }
+        fclose(b.out[l]);
+    }
+    *steps += b.steps;
+    *lane_steps += b.lane_steps;
+    free(b.memory);
+}
+
+/* Run Scalar, the plain interpreter for comparison */
+void run_scalar(const Image* image, Job* job, uint32_t budget, FILE* null_in)
+{
+    VM vm;
+    FILE* in = open_input(job, null_in);
+    FILE* out = open_memstream(&job->output, &job->output_size);
+    vm_init(&vm, image, in, out);
+    job->executed = vm_run(&vm, budget);
+    vm_free(&vm);
+    if (in != null_in) { fclose(in); }
+    fclose(out);
+}
+
+
+int main(int argc, const char* argv[])
+{
+    /* Load Arguments */
+    uint32_t budget = 10000000;
+    int job_count = 0;
+    int threads = std::thread::hardware_concurrency();
+
+    int j = 1;
+    for (; j + 1 < argc && argv[j][0] == '-'; j += 2)
+    {
+        if (!strcmp(argv[j], "-b")) { budget = strtoul(argv[j + 1], NULL, 0); }
+        else if (!strcmp(argv[j], "-j")) { job_count = atoi(argv[j + 1]); }
+        else if (!strcmp(argv[j], "-t")) { threads = atoi(argv[j + 1]); }
+        else { break; }
+    }
+
+    if (j >= argc)
+    {
+        /* show usage string */
+        printf("lc3-simd [-b budget] [-j jobs] [-t threads] [image-file] [input-file1] ...\n");
+        exit(2);
+    }
+    if (threads < 1) { threads = 1; }
+
+    Image* image = image_alloc();
+    if (!read_image(image, argv[j]))
+    {
+        printf("failed to load image: %s\n", argv[j]);
+        exit(1);
+    }
+    ++j;
+
+    /* job k reads input file k % inputs, or nothing */
+    std::vector<char*> inputs(argc - j);
+    std::vector<size_t> input_sizes(argc - j);
+    for (int i = 0; j + i < argc; ++i)
+    {
+        if (!(inputs[i] = read_file(argv[j + i], &input_sizes[i])))
+        {
+            printf("failed to load input: %s\n", argv[j + i]);
+            exit(1);
+        }
+    }
+    if (!job_count) { job_count = LANES * threads; }
+
+    std::vector<Job> simd_jobs(job_count);
+    for (int k = 0; k < job_count; ++k)
+    {
+        Job& job = simd_jobs[k];
+        memset(&job, 0, sizeof(job));
+        if (!inputs.empty())
+        {
+            job.input = inputs[k % inputs.size()];
+            job.input_size = input_sizes[k % inputs.size()];
+        }
+    }
+    std::vector<Job> scalar_jobs = simd_jobs;
+
+    FILE* null_in = fopen("/dev/null", "rb");
+
+    /* Lockstep, every thread takes LANES jobs at a time */
+    std::atomic<int> next(0);
+    std::atomic<uint64_t> steps(0), lane_steps(0);
+    std::vector<std::thread> workers;
+    double t0 = now();
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&]() {
+            uint64_t s = 0, ls = 0;
+            int k;
+            while ((k = next.fetch_add(LANES)) < job_count)
+            {
+                int count = job_count - k < LANES ? job_count - k : LANES;
+                run_batch(image, &simd_jobs[k], count, budget, null_in, &s, &ls);
+            }
+            steps += s;
+            lane_steps += ls;
+        });
+    }
+    for (std::thread& w : workers) { w.join(); }
+    double simd_time = now() - t0;
+
+    /* Scalar, every thread takes one job at a time */
+    next = 0;
+    workers.clear();
+    t0 = now();
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&]() {
+            int k;
+            while ((k = next.fetch_add(1)) < job_count)
+            {
+                run_scalar(image, &scalar_jobs[k], budget, null_in);
+            }
+        });
+    }
+    for (std::thread& w : workers) { w.join(); }
+    double scalar_time = now() - t0;
+
+    /* Report */
+    uint64_t simd_ins = 0, scalar_ins = 0;
+    int mismatches = 0;
+    for (int k = 0; k < job_count; ++k)
+    {
+        simd_ins += simd_jobs[k].executed;
+        scalar_ins += scalar_jobs[k].executed;
+        if (simd_jobs[k].executed != scalar_jobs[k].executed
+            || simd_jobs[k].output_size != scalar_jobs[k].output_size
+            || memcmp(simd_jobs[k].output, scalar_jobs[k].output, simd_jobs[k].output_size))
+        {
+            ++mismatches;
+        }
+        free(simd_jobs[k].output);
+        free(scalar_jobs[k].output);
+    }
+
+    printf("jobs:             %d on %d threads, %d lanes\n", job_count, threads, LANES);
+    printf("lockstep:         %llu instructions in %.3f s, %.1f MIPS\n",
+           (unsigned long long)simd_ins, simd_time, simd_ins / simd_time / 1e6);
+    printf("lane utilisation: %.1f%% (%llu vector steps)\n",
+           steps ? 100.0 * lane_steps / ((double)steps * LANES) : 0.0,
+           (unsigned long long)steps.load());
+    printf("scalar:           %llu instructions in %.3f s, %.1f MIPS\n",
+           (unsigned long long)scalar_ins, scalar_time, scalar_ins / scalar_time / 1e6);
+    printf("speedup:          %.2fx\n", scalar_time / simd_time);
+    printf("outputs:          %s\n", mismatches ? "MISMATCH" : "match");
+
+    for (char* input : inputs) { free(input); }
+    free(image);
+    return mismatches ? 1 : 0;
+}
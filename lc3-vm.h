@@ -0,0 +1,686 @@
+/*
+ * Instance-based LC-3 core for the POSIX tools.
+ *
+ * Same ins<op> decoding as lc3-alt.cpp, but the machine state lives in a
+ * VM struct instead of globals. Memory is reached through a page table so
+ * any number of VMs can share one loaded Image and only get a private copy
+ * of a page on their first store to it.
+ */
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+#include <stdint.h>     // uint16_t
+#include <stdio.h>      // FILE
+#include <stdlib.h>     // malloc, abort
+#include <string.h>     // memcpy
+#include <time.h>       // clock_gettime
+#include <signal.h>     // SIGINT
+#include <sys/select.h> // select
+#include <termios.h>    // tcgetattr
+#include <unistd.h>     // STDIN_FILENO
+
+
+/* Registers */
+enum
+{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC, /* program counter */
+    R_COND,
+    R_COUNT
+};
+
+/* Condition Flags */
+enum
+{
+    FL_POS = 1 << 0, /* P */
+    FL_ZRO = 1 << 1, /* Z */
+    FL_NEG = 1 << 2, /* N */
+};
+
+/* Opcodes */
+enum
+{
+    OP_BR = 0, /* branch */
+    OP_ADD,    /* add  */
+    OP_LD,     /* load */
+    OP_ST,     /* store */
+    OP_JSR,    /* jump register */
+    OP_AND,    /* bitwise and */
+    OP_LDR,    /* load register */
+    OP_STR,    /* store register */
+    OP_RTI,    /* unused */
+    OP_NOT,    /* bitwise not */
+    OP_LDI,    /* load indirect */
+    OP_STI,    /* store indirect */
+    OP_JMP,    /* jump */
+    OP_RES,    /* reserved (unused) */
+    OP_LEA,    /* load effective address */
+    OP_TRAP    /* execute trap */
+};
+
+/* Memory Mapped Registers */
+enum
+{
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02  /* keyboard data */
+};
+
+enum { IO_PAGE = 0xFE }; /* the page every device register lives on */
+
+/* TRAP Codes */
+enum
+{
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
+
+enum { PC_START = 0x3000 };
+
+/* Paging */
+enum
+{
+    PAGE_BITS = 8,
+    PAGE_SIZE = 1 << PAGE_BITS, /* words per page */
+    PAGE_MASK = PAGE_SIZE - 1,
+    PAGE_COUNT = 1 << (16 - PAGE_BITS)
+};
+
+/* Page Flags, any bit set sends stores to that page down the slow path */
+enum
+{
+    PAGE_COW = 1 << 0, /* still shared with the image, copy before writing */
+    PAGE_CODE = 1 << 1, /* holds translated code, cleared once a store changes it */
+    PAGE_WATCH = 1 << 2, /* overlaps a watchpoint, stores are range checked */
+    PAGE_IO = 1 << 3 /* device registers, stores are offered to io_write first */
+};
+
+
+/* Image: pristine memory and registers that VMs are cloned from */
+struct Image
+{
+    uint16_t memory[1 << 16];
+    uint16_t reg[R_COUNT];
+};
+
+struct Watch;
+
+/* VM */
+struct VM
+{
+    uint16_t* priv;               /* private pages, packed in the order they were copied */
+    uint8_t slot[PAGE_COUNT];     /* where a page without PAGE_COW sits in priv */
+    uint8_t pflags[PAGE_COUNT];   /* PAGE_* bits per page */
+    uint16_t reg[R_COUNT];
+    int running;
+    uint32_t private_pages;       /* pages copied out of the image */
+    const Image* image;
+    const uint8_t* code_map;      /* non-zero for translated words on PAGE_CODE pages */
+    const Watch* watches;         /* checked on PAGE_WATCH pages */
+    int watch_count;
+    void* io;                     /* device state for io_read/io_write */
+    int (*io_read)(VM* vm, uint16_t address, uint16_t* val);  /* non-zero if handled */
+    int (*io_write)(VM* vm, uint16_t address, uint16_t val);  /* non-zero if handled */
+    FILE* in;
+    FILE* out;
+};
+
+
+/* Watch: a range of words whose stores call hit before they land */
+struct Watch
+{
+    uint16_t lo;
+    uint16_t hi; /* inclusive */
+    int (*hit)(VM* vm, const Watch* watch, uint16_t address, uint16_t old, uint16_t val); /* non-zero stops the VM */
+    void* user;
+};
+
+
+/* Sign Extend */
+inline uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+/* Swap */
+inline uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+/* Update Flags */
+inline void update_flags(VM* vm, uint16_t r)
+{
+    if (vm->reg[r] == 0)
+    {
+        vm->reg[R_COND] = FL_ZRO;
+    }
+    else if (vm->reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    {
+        vm->reg[R_COND] = FL_NEG;
+    }
+    else
+    {
+        vm->reg[R_COND] = FL_POS;
+    }
+}
+
+
+/* Image Allocation */
+inline Image* image_alloc()
+{
+    Image* image = (Image*)calloc(1, sizeof(Image));
+    if (!image) { abort(); }
+    image->reg[R_PC] = PC_START;
+    image->reg[R_COND] = FL_ZRO;
+    return image;
+}
+
+/* Read Image File */
+inline void read_image_file(Image* image, FILE* file)
+{
+    /* the origin tells us where in memory to place the image */
+    uint16_t origin;
+    if (fread(&origin, sizeof(origin), 1, file) != 1) { return; }
+    origin = swap16(origin);
+
+    /* we know the maximum file size so we only need one fread */
+    size_t max_read = (1 << 16) - origin;
+    uint16_t* p = image->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    /* swap to little endian */
+    while (read-- > 0)
+    {
+        *p = swap16(*p);
+        ++p;
+    }
+}
+
+/* Read Image */
+inline int read_image(Image* image, const char* image_path)
+{
+    FILE* file = fopen(image_path, "rb");
+    if (!file) { return 0; };
+    read_image_file(image, file);
+    fclose(file);
+    return 1;
+}
+
+
+/* VM Lifetime */
+inline void vm_init(VM* vm, const Image* image, FILE* in, FILE* out)
+{
+    /* every page starts out shared with the image, so the page table is
+       just two bytes a page and an instance costs little more than the
+       pages it writes */
+    vm->priv = NULL;
+    memset(vm->slot, 0, sizeof(vm->slot));
+    memset(vm->pflags, PAGE_COW, sizeof(vm->pflags));
+    memcpy(vm->reg, image->reg, sizeof(vm->reg));
+    vm->running = 1;
+    vm->private_pages = 0;
+    vm->image = image;
+    vm->code_map = NULL;
+    vm->watches = NULL;
+    vm->watch_count = 0;
+    vm->io = NULL;
+    vm->io_read = NULL;
+    vm->io_write = NULL;
+    vm->in = in;
+    vm->out = out;
+}
+
+inline void vm_free(VM* vm)
+{
+    free(vm->priv);
+    vm->priv = NULL;
+    vm->private_pages = 0;
+}
+
+/* Devices, either hook may be NULL, io_write only sees stores once the page is flagged */
+inline void vm_attach(VM* vm, void* io,
+                      int (*io_read)(VM*, uint16_t, uint16_t*),
+                      int (*io_write)(VM*, uint16_t, uint16_t))
+{
+    vm->io = io;
+    vm->io_read = io_read;
+    vm->io_write = io_write;
+    if (io_write) { vm->pflags[IO_PAGE] |= PAGE_IO; }
+}
+
+/* Watchpoints, only the pages they overlap leave the fast path,
+   the list is borrowed and must outlive the VM or the next call */
+inline void vm_watch(VM* vm, const Watch* watches, int count)
+{
+    for (int p = 0; p < PAGE_COUNT; ++p)
+    {
+        vm->pflags[p] &= ~PAGE_WATCH;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        for (int p = watches[i].lo >> PAGE_BITS; p <= watches[i].hi >> PAGE_BITS; ++p)
+        {
+            vm->pflags[p] |= PAGE_WATCH;
+        }
+    }
+    vm->watches = watches;
+    vm->watch_count = count;
+}
+
+/* drop every private page and start over from the image,
+   watchpoints and devices stay attached */
+inline void vm_reset(VM* vm)
+{
+    VM old = *vm;
+    vm_free(vm);
+    vm_init(vm, old.image, old.in, old.out);
+    if (old.watch_count) { vm_watch(vm, old.watches, old.watch_count); }
+    if (old.io_read || old.io_write) { vm_attach(vm, old.io, old.io_read, old.io_write); }
+}
+
+/* Snapshot, freezes a (warmed up) VM into an image to clone from */
+inline void image_snapshot(Image* image, const VM* vm)
+{
+    for (int p = 0; p < PAGE_COUNT; ++p)
+    {
+        if (!(vm->pflags[p] & PAGE_COW))
+        {
+            memcpy(image->memory + (p << PAGE_BITS), vm->priv + (vm->slot[p] << PAGE_BITS),
+                   PAGE_SIZE * sizeof(uint16_t));
+        }
+    }
+    memcpy(image->reg, vm->reg, sizeof(image->reg));
+}
+
+
+/* Check Key */
+inline uint16_t check_key(FILE* in)
+{
+    int fd = fileno(in);
+    if (fd < 0)
+    {
+        /* memory stream, a key is waiting unless we hit the end */
+        int c = getc(in);
+        if (c == EOF) { return 0; }
+        ungetc(c, in);
+        return 1;
+    }
+
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    return select(fd + 1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+/* Input Buffering */
+static struct termios original_tio;
+
+inline void disable_input_buffering()
+{
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+inline void restore_input_buffering()
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+/* Handle Interrupt */
+inline void handle_interrupt(int signal)
+{
+    (void)signal;
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
+
+/* Time */
+inline double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Read File, a whole input file to replay; works on pipes too */
+inline char* read_file(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) { return NULL; }
+
+    size_t capacity = 4096;
+    char* data = (char*)malloc(capacity);
+    *size = 0;
+    size_t n;
+    while (data && (n = fread(data + *size, 1, capacity - *size, file)) > 0)
+    {
+        *size += n;
+        if (*size == capacity)
+        {
+            capacity *= 2;
+            data = (char*)realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    if (!data) { abort(); }
+    return data;
+}
+
+/* Memory Access */
+inline uint16_t* mem_page(const VM* vm, uint16_t p)
+{
+    /* the cast is safe because PAGE_COW keeps stores away from the image */
+    if (vm->pflags[p] & PAGE_COW)
+    {
+        return (uint16_t*)vm->image->memory + (p << PAGE_BITS);
+    }
+    return vm->priv + (vm->slot[p] << PAGE_BITS);
+}
+
+inline uint16_t mem_peek(const VM* vm, uint16_t address)
+{
+    return mem_page(vm, address >> PAGE_BITS)[address & PAGE_MASK];
+}
+
+/* stores to flagged pages, kept out of line so mem_write stays small */
+__attribute__((noinline)) inline void mem_write_slow(VM* vm, uint16_t address, uint16_t val)
+{
+    uint16_t p = address >> PAGE_BITS;
+    if ((vm->pflags[p] & PAGE_IO) && vm->io_write && vm->io_write(vm, address, val))
+    {
+        return;
+    }
+    if (vm->pflags[p] & PAGE_COW)
+    {
+        /* grown a page at a time, most programs only ever write a few */
+        size_t used = vm->private_pages << PAGE_BITS;
+        uint16_t* priv = (uint16_t*)realloc(vm->priv, (used + PAGE_SIZE) * sizeof(uint16_t));
+        if (!priv) { abort(); }
+        memcpy(priv + used, vm->image->memory + (p << PAGE_BITS), PAGE_SIZE * sizeof(uint16_t));
+        vm->priv = priv;
+        vm->slot[p] = (uint8_t)vm->private_pages++;
+        vm->pflags[p] &= ~PAGE_COW;
+    }
+    if (vm->pflags[p] & PAGE_WATCH)
+    {
+        uint16_t old = mem_peek(vm, address);
+        for (int i = 0; i < vm->watch_count; ++i)
+        {
+            const Watch* w = &vm->watches[i];
+            if (address >= w->lo && address <= w->hi && w->hit(vm, w, address, old, val))
+            {
+                vm->running = 0;
+            }
+        }
+    }
+    if ((vm->pflags[p] & PAGE_CODE) && vm->code_map[address]
+        && mem_peek(vm, address) != val)
+    {
+        /* self-modifying code, the page goes back to the interpreter */
+        vm->pflags[p] &= ~PAGE_CODE;
+    }
+    mem_page(vm, p)[address & PAGE_MASK] = val;
+}
+
+inline void mem_write(VM* vm, uint16_t address, uint16_t val)
+{
+    uint16_t p = address >> PAGE_BITS;
+    if (vm->pflags[p])
+    {
+        mem_write_slow(vm, address, val);
+        return;
+    }
+    /* no flags, so the page is private */
+    vm->priv[(vm->slot[p] << PAGE_BITS) | (address & PAGE_MASK)] = val;
+}
+
+/* loads from the device page, the keyboard first, then any attached device */
+__attribute__((noinline)) inline uint16_t mem_read_io(VM* vm, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        if (check_key(vm->in))
+        {
+            mem_write(vm, MR_KBSR, 1 << 15);
+            mem_write(vm, MR_KBDR, getc(vm->in));
+        }
+        else
+        {
+            mem_write(vm, MR_KBSR, 0);
+        }
+    }
+    uint16_t val;
+    if (vm->io_read && vm->io_read(vm, address, &val))
+    {
+        return val;
+    }
+    return mem_peek(vm, address);
+}
+
+inline uint16_t mem_read(VM* vm, uint16_t address)
+{
+    if ((address >> PAGE_BITS) == IO_PAGE)
+    {
+        return mem_read_io(vm, address);
+    }
+    return mem_peek(vm, address);
+}
+
+
+
+/* Get Char, a blocking key read for GETC and IN, offered to the device
+   as a KBDR load first so it can catch up (a renderer drawing the screen) */
+inline uint16_t vm_getc(VM* vm)
+{
+    uint16_t val;
+    if (vm->io_read && vm->io_read(vm, MR_KBDR, &val))
+    {
+        return val;
+    }
+    return (uint16_t)getc(vm->in);
+}
+
+
+/* Instruction */
+template <unsigned op>
+void ins(VM* vm, uint16_t instr)
+{
+    uint16_t* reg = vm->reg;
+    uint16_t r0, r1, r2, imm5, imm_flag;
+    uint16_t pc_plus_off, base_plus_off;
+
+    constexpr uint16_t opbit = (1 << op);
+    if (0x4EEE & opbit) { r0 = (instr >> 9) & 0x7; }
+    if (0x12F3 & opbit) { r1 = (instr >> 6) & 0x7; }
+    if (0x0022 & opbit)
+    {
+        imm_flag = (instr >> 5) & 0x1;
+
+        if (imm_flag)
+        {
+            imm5 = sign_extend(instr & 0x1F, 5);
+        }
+        else
+        {
+            r2 = instr & 0x7;
+        }
+    }
+    if (0x00C0 & opbit)
+    {   // Base + offset
+        base_plus_off = reg[r1] + sign_extend(instr & 0x3F, 6);
+    }
+    if (0x4C0D & opbit)
+    {
+        // Indirect address
+        pc_plus_off = reg[R_PC] + sign_extend(instr & 0x1FF, 9);
+    }
+    if (0x0001 & opbit)
+    {
+        // BR
+        uint16_t cond = (instr >> 9) & 0x7;
+        if (cond & reg[R_COND]) { reg[R_PC] = pc_plus_off; }
+    }
+    if (0x0002 & opbit)  // ADD
+    {
+        if (imm_flag)
+        {
+            reg[r0] = reg[r1] + imm5;
+        }
+        else
+        {
+            reg[r0] = reg[r1] + reg[r2];
+        }
+    }
+    if (0x0020 & opbit)  // AND
+    {
+        if (imm_flag)
+        {
+            reg[r0] = reg[r1] & imm5;
+        }
+        else
+        {
+            reg[r0] = reg[r1] & reg[r2];
+        }
+    }
+    if (0x0200 & opbit) { reg[r0] = ~reg[r1]; } // NOT
+    if (0x1000 & opbit) { reg[R_PC] = reg[r1]; } // JMP
+    if (0x0010 & opbit)  // JSR
+    {
+        uint16_t long_flag = (instr >> 11) & 1;
+        uint16_t base = reg[r1]; /* read before R7 is clobbered, JSRR R7 */
+        reg[R_R7] = reg[R_PC];
+        if (long_flag)
+        {
+            pc_plus_off = reg[R_PC] + sign_extend(instr & 0x7FF, 11);
+            reg[R_PC] = pc_plus_off;
+        }
+        else
+        {
+            reg[R_PC] = base;
+        }
+    }
+
+    if (0x0004 & opbit) { reg[r0] = mem_read(vm, pc_plus_off); } // LD
+    if (0x0400 & opbit) { reg[r0] = mem_read(vm, mem_read(vm, pc_plus_off)); } // LDI
+    if (0x0040 & opbit) { reg[r0] = mem_read(vm, base_plus_off); }  // LDR
+    if (0x4000 & opbit) { reg[r0] = pc_plus_off; } // LEA
+    if (0x0008 & opbit) { mem_write(vm, pc_plus_off, reg[r0]); } // ST
+    if (0x0800 & opbit) { mem_write(vm, mem_read(vm, pc_plus_off), reg[r0]); } // STI
+    if (0x0080 & opbit) { mem_write(vm, base_plus_off, reg[r0]); } // STR
+    if (0x8000 & opbit)  // TRAP
+    {
+         switch (instr & 0xFF)
+         {
+             case TRAP_GETC:
+                 /* read a single ASCII char */
+                 reg[R_R0] = vm_getc(vm);
+
+                 break;
+             case TRAP_OUT:
+                 putc((char)reg[R_R0], vm->out);
+                 fflush(vm->out);
+
+                 break;
+             case TRAP_PUTS:
+                 {
+                     /* one char per word */
+                     uint16_t a = reg[R_R0];
+                     uint16_t c;
+                     while ((c = mem_peek(vm, a++)))
+                     {
+                         putc((char)c, vm->out);
+                     }
+                     fflush(vm->out);
+                 }
+
+                 break;
+             case TRAP_IN:
+                 {
+                     fprintf(vm->out, "Enter a character: ");
+                     char c = vm_getc(vm);
+                     putc(c, vm->out);
+                     reg[R_R0] = (uint16_t)c;
+                 }
+
+                 break;
+             case TRAP_PUTSP:
+                 {
+                     /* one char per byte (two bytes per word)
+                        here we need to swap back to
+                        big endian format */
+                     uint16_t a = reg[R_R0];
+                     uint16_t c;
+                     while ((c = mem_peek(vm, a++)))
+                     {
+                         char char1 = c & 0xFF;
+                         putc(char1, vm->out);
+                         char char2 = c >> 8;
+                         if (char2) putc(char2, vm->out);
+                     }
+                     fflush(vm->out);
+                 }
+
+                 break;
+             case TRAP_HALT:
+                 fputs("HALT\n", vm->out);
+                 fflush(vm->out);
+                 vm->running = 0;
+
+                 break;
+         }
+
+    }
+    //if (0x0100 & opbit) { } // RTI
+    if (0x4666 & opbit) { update_flags(vm, r0); }
+}
+
+/* RTI and the reserved opcode stop the VM instead of crashing the host */
+inline void ins_bad(VM* vm, uint16_t instr)
+{
+    (void)instr;
+    vm->running = 0;
+}
+
+/* Op Table */
+static void (*const op_table[16])(VM*, uint16_t) = {
+    ins<0>, ins<1>, ins<2>, ins<3>,
+    ins<4>, ins<5>, ins<6>, ins<7>,
+    ins_bad, ins<9>, ins<10>, ins<11>,
+    ins<12>, ins_bad, ins<14>, ins<15>
+};
+
+/* Run, returns the number of instructions executed within budget */
+inline uint64_t vm_run(VM* vm, uint64_t budget)
+{
+    uint64_t n = 0;
+    while (vm->running && n < budget)
+    {
+        uint16_t instr = mem_read(vm, vm->reg[R_PC]++);
+        op_table[instr >> 12](vm, instr);
+        ++n;
+    }
+    return n;
+}
+
+#endif